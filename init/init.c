@@ -37,10 +37,14 @@
 #include <dirent.h>
 #include <time.h>
 #include <termios.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
 
 #if MAJOR_IN_MKDEV
 #include <sys/mkdev.h>
@@ -58,16 +62,36 @@
 /* Maximum time to wait for the root device to appear (seconds).
  *
  * On slow machines with lots of disks (Koji running the 255 disk test
- * in libguestfs) this really can take several minutes.
- *
- * Note that the actual wait time is approximately double the number
- * given here because there is a delay which doubles until it reaches
- * this value.
+ * in libguestfs) this really can take several minutes.  This used to
+ * be 300 with a doubling delay, which in fact waited about 600s.
+ */
+#define MAX_ROOT_WAIT 600
+
+/* Longest single wait between checks for the root device (ns).  We
+ * are woken up early by uevents, so this only matters if those
+ * cannot be received.
  */
-#define MAX_ROOT_WAIT 300
+#define MAX_ROOT_DELAY UINT64_C(1000000000)
 
 extern long init_module (void *, unsigned long, const char *);
 
+/* Added in Linux 5.17. */
+#ifndef MODULE_INIT_COMPRESSED_FILE
+#define MODULE_INIT_COMPRESSED_FILE 4
+#endif
+
+/* finit_module (Linux >= 3.8) is not wrapped by all C libraries. */
+static long
+do_finit_module (int fd, const char *params, int flags)
+{
+#ifdef SYS_finit_module
+  return syscall (SYS_finit_module, fd, params, flags);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
 /* translation taken from module-init-tools/insmod.c  */
 static const char *moderror(int err)
 {
@@ -90,9 +114,16 @@ static const char *moderror(int err)
  */
 static int quiet = 0;
 
+/* If "supermin.timing" is found on the command line, set this which
+ * prints how long each step of the boot takes.
+ */
+static int timing = 0;
+
 static void mount_proc (void);
 static void print_uptime (void);
 static void read_cmdline (void);
+static void load_modules (void);
+static void load_module (const char *filename);
 static void insmod (const char *filename);
 static void delete_initramfs_files (void);
 static void show_directory (const char *dir);
@@ -100,7 +131,13 @@ static void parse_root_uuid (const char *uuid, unsigned char *raw_uuid);
 static int hexdigit (char d);
 static int find_fs_uuid (const unsigned char *raw_uuid, int *major, int *minor);
 static int parse_dev_file (const char *path, int *major, int *minor);
-static void virtio_warning (uint64_t delay_ns, const char *what);
+static const char *root_fs_type (const char *dev);
+static void virtio_warning (uint64_t waited_ns, const char *what);
+static uint64_t get_time_ns (void);
+static void print_timing (const char *phase, const char *arg, uint64_t start_ns);
+static void open_uevent_socket (void);
+static void close_uevent_socket (void);
+static int wait_for_block_device (uint64_t delay_ns, uint64_t deadline_ns);
 
 static char cmdline[1024];
 static char line[1024];
@@ -108,21 +145,15 @@ static char line[1024];
 int
 main ()
 {
-  FILE *fp;
   char *root;
   size_t len;
   int dax = 0;
-  uint64_t delay_ns;
+  uint64_t delay_ns, deadline_ns;
+  uint64_t start_ns, init_start_ns = get_time_ns ();
   int major, minor;
+  const char *fs_type;
   const char *mount_options = "";
 
-#define NANOSLEEP(ns) do {                      \
-    struct timespec t;                          \
-    t.tv_sec = delay_ns / 1000000000;           \
-    t.tv_nsec = delay_ns % 1000000000;          \
-    nanosleep (&t, NULL);                       \
-  } while(0)
-
   mount_proc ();
 
   fprintf (stderr, "supermin: ext2 mini initrd starting up: "
@@ -140,6 +171,7 @@ main ()
 
   read_cmdline ();
   quiet = strstr (cmdline, "quiet") != NULL;
+  timing = strstr (cmdline, "supermin.timing") != NULL;
 
   if (!quiet) {
     fprintf (stderr, "supermin: cmdline: %s\n", cmdline);
@@ -151,35 +183,19 @@ main ()
   mkdir ("/root", 0755);
   mkdir ("/sys", 0755);
 
+  print_timing ("start", NULL, init_start_ns);
+
   /* Mount /sys. */
   if (!quiet)
     fprintf (stderr, "supermin: mounting /sys\n");
+  start_ns = get_time_ns ();
   if (mount ("sysfs", "/sys", "sysfs", 0, "") == -1) {
     perror ("mount: /sys");
     exit (EXIT_FAILURE);
   }
+  print_timing ("mount-sys", NULL, start_ns);
 
-  fp = fopen ("/modules", "r");
-  if (fp == NULL) {
-    perror ("fopen: /modules");
-    exit (EXIT_FAILURE);
-  }
-  while (fgets (line, sizeof line, fp)) {
-    size_t n = strlen (line);
-    if (n > 0 && line[n-1] == '\n')
-      line[--n] = '\0';
-
-    /* XXX Because of the way we construct the module list, the
-     * "modules" file can contain non-existent modules.  Ignore those
-     * for now.  Really we should add them as missing dependencies.
-     * See src/ext2_initrd.ml.
-     */
-    if (access (line, R_OK) == 0)
-      insmod (line);
-    else
-      fprintf (stderr, "skipped %s, module is missing\n", line);
-  }
-  fclose (fp);
+  load_modules ();
 
   /* Look for the ext2 filesystem root device specified as root=...
    * on the kernel command line.
@@ -191,6 +207,16 @@ main ()
   }
   root += 5;
 
+  /* Wait for the root device to appear.  We check for it, and if it
+   * is not there yet wait until the kernel tells us a block device
+   * has been added (or until the delay expires, in case we cannot
+   * receive uevents), then check again.  The socket must be opened
+   * before the first check so that no uevent can be missed.
+   */
+  open_uevent_socket ();
+  start_ns = get_time_ns ();
+  deadline_ns = start_ns + MAX_ROOT_WAIT * UINT64_C(1000000000);
+
   if (strncmp (root, "/dev/", 5) == 0) {
     char *path;
 
@@ -202,9 +228,7 @@ main ()
 
     asprintf (&path, "/sys/block/%s/dev", root);
 
-    for (delay_ns = 250000;
-         delay_ns <= MAX_ROOT_WAIT * UINT64_C(1000000000);
-         delay_ns *= 2) {
+    for (delay_ns = 250000; get_time_ns () < deadline_ns; ) {
       if (parse_dev_file (path, &major, &minor) != -1) {
         if (!quiet)
           fprintf (stderr, "supermin: picked %s (%d:%d) as root device\n",
@@ -212,8 +236,12 @@ main ()
         break;
       }
 
-      virtio_warning (delay_ns, path);
-      NANOSLEEP (delay_ns);
+      virtio_warning (get_time_ns () - start_ns, path);
+      if (!wait_for_block_device (delay_ns, deadline_ns)) {
+        delay_ns *= 2;
+        if (delay_ns > MAX_ROOT_DELAY)
+          delay_ns = MAX_ROOT_DELAY;
+      }
     }
 
     free (path);
@@ -224,9 +252,7 @@ main ()
     root += 5;
     parse_root_uuid (root, raw_uuid);
 
-    for (delay_ns = 250000;
-         delay_ns <= MAX_ROOT_WAIT * UINT64_C(1000000000);
-         delay_ns *= 2) {
+    for (delay_ns = 250000; get_time_ns () < deadline_ns; ) {
       if (find_fs_uuid (raw_uuid, &major, &minor) != -1) {
         if (!quiet)
           fprintf (stderr, "supermin: picked %d:%d as root device\n",
@@ -234,8 +260,12 @@ main ()
         break;
       }
 
-      virtio_warning (delay_ns, "root UUID");
-      NANOSLEEP (delay_ns);
+      virtio_warning (get_time_ns () - start_ns, "root UUID");
+      if (!wait_for_block_device (delay_ns, deadline_ns)) {
+        delay_ns *= 2;
+        if (delay_ns > MAX_ROOT_DELAY)
+          delay_ns = MAX_ROOT_DELAY;
+      }
     }
   }
   else {
@@ -243,6 +273,9 @@ main ()
     exit (EXIT_FAILURE);
   }
 
+  close_uevent_socket ();
+  print_timing ("root-wait", NULL, start_ns);
+
   if (umount ("/sys") == -1) {
     perror ("umount: /sys");
     exit (EXIT_FAILURE);
@@ -263,21 +296,26 @@ main ()
     mount_options = "dax";
 
   /* Mount new root and chroot to it. */
+  fs_type = root_fs_type ("/dev/root");
   if (!quiet) {
-    fprintf (stderr, "supermin: mounting new root on /root");
+    fprintf (stderr, "supermin: mounting new root on /root (%s", fs_type);
     if (mount_options[0] != '\0')
-      fprintf (stderr, " (%s)", mount_options);
-    fprintf (stderr, "\n");
+      fprintf (stderr, ", %s", mount_options);
+    fprintf (stderr, ")\n");
   }
-  if (mount ("/dev/root", "/root", "ext2", MS_NOATIME,
+  start_ns = get_time_ns ();
+  if (mount ("/dev/root", "/root", fs_type, MS_NOATIME,
              mount_options) == -1) {
     perror ("mount: /root");
     exit (EXIT_FAILURE);
   }
+  print_timing ("mount-root", fs_type, start_ns);
 
   if (!quiet)
     fprintf (stderr, "supermin: deleting initramfs files\n");
+  start_ns = get_time_ns ();
   delete_initramfs_files ();
+  print_timing ("delete-initramfs", NULL, start_ns);
 
   /* Note that pivot_root won't work.  See the note in Linux
    * Documentation/filesystems/ramfs-rootfs-initramfs.rst
@@ -293,6 +331,7 @@ main ()
   chdir ("/");
 
   /* Run /init from ext2 filesystem. */
+  print_timing ("exec", "/init", init_start_ns);
   execl ("/init", "init", NULL);
   perror ("execl: /init");
 
@@ -309,6 +348,168 @@ main ()
   exit (EXIT_FAILURE);
 }
 
+/* The "modules" file has one line per module, listing the module
+ * followed by the modules it depends on, which always come earlier in
+ * the file.  Modules are loaded in separate processes so that modules
+ * which do not depend on each other are initialized in parallel.
+ */
+struct module {
+  char *filename;
+  size_t *deps;                 /* indexes of modules it depends on */
+  size_t nr_deps;
+  pid_t pid;                    /* process loading it, or 0 */
+  int loaded;
+};
+
+static void
+load_modules (void)
+{
+  FILE *fp;
+  struct module *modules = NULL;
+  size_t nr_modules = 0, nr_loaded = 0, i, j;
+  long max_running;
+  int running = 0;
+
+  fp = fopen ("/modules", "r");
+  if (fp == NULL) {
+    perror ("fopen: /modules");
+    exit (EXIT_FAILURE);
+  }
+  while (fgets (line, sizeof line, fp)) {
+    struct module *m;
+    char *p, *name;
+    size_t n = strlen (line);
+    if (n > 0 && line[n-1] == '\n')
+      line[--n] = '\0';
+    if (n == 0)
+      continue;
+
+    modules = realloc (modules, (nr_modules+1) * sizeof (struct module));
+    if (modules == NULL) {
+      perror ("realloc");
+      exit (EXIT_FAILURE);
+    }
+    m = &modules[nr_modules];
+    memset (m, 0, sizeof *m);
+
+    p = line;
+    name = strsep (&p, " ");
+    m->filename = strdup (name);
+    if (m->filename == NULL) {
+      perror ("strdup");
+      exit (EXIT_FAILURE);
+    }
+    while ((name = strsep (&p, " ")) != NULL) {
+      for (j = 0; j < nr_modules; ++j) {
+        if (strcmp (modules[j].filename, name) == 0) {
+          m->deps = realloc (m->deps, (m->nr_deps+1) * sizeof (size_t));
+          if (m->deps == NULL) {
+            perror ("realloc");
+            exit (EXIT_FAILURE);
+          }
+          m->deps[m->nr_deps++] = j;
+          break;
+        }
+      }
+    }
+    nr_modules++;
+  }
+  fclose (fp);
+
+  max_running = sysconf (_SC_NPROCESSORS_ONLN);
+
+  /* With a single CPU, load the modules in order in this process. */
+  if (max_running <= 1) {
+    for (i = 0; i < nr_modules; ++i)
+      load_module (modules[i].filename);
+    goto out;
+  }
+
+  while (nr_loaded < nr_modules) {
+    size_t prev_loaded = nr_loaded;
+    pid_t pid;
+    int status;
+
+    /* Start loading every module whose dependencies are loaded. */
+    for (i = 0; i < nr_modules && running < max_running; ++i) {
+      struct module *m = &modules[i];
+
+      if (m->loaded || m->pid > 0)
+        continue;
+      for (j = 0; j < m->nr_deps; ++j)
+        if (!modules[m->deps[j]].loaded)
+          break;
+      if (j < m->nr_deps)
+        continue;
+
+      pid = fork ();
+      if (pid == 0) {
+        load_module (m->filename);
+        _exit (EXIT_SUCCESS);
+      }
+      if (pid == -1) {
+        perror ("fork");
+        load_module (m->filename);
+        m->loaded = 1;
+        nr_loaded++;
+        continue;
+      }
+      m->pid = pid;
+      running++;
+    }
+
+    if (running == 0) {
+      if (nr_loaded > prev_loaded)
+        continue;
+      break;
+    }
+
+    /* Wait for one of them to finish. */
+    pid = wait (&status);
+    if (pid == -1) {
+      perror ("wait");
+      exit (EXIT_FAILURE);
+    }
+    for (i = 0; i < nr_modules; ++i) {
+      if (modules[i].pid == pid) {
+        modules[i].pid = 0;
+        modules[i].loaded = 1;
+        nr_loaded++;
+        running--;
+        break;
+      }
+    }
+    if (!WIFEXITED (status) || WEXITSTATUS (status) != EXIT_SUCCESS)
+      exit (EXIT_FAILURE);
+  }
+
+ out:
+  for (i = 0; i < nr_modules; ++i) {
+    free (modules[i].filename);
+    free (modules[i].deps);
+  }
+  free (modules);
+}
+
+static void
+load_module (const char *filename)
+{
+  uint64_t start_ns;
+
+  /* XXX Because of the way we construct the module list, the
+   * "modules" file can contain non-existent modules.  Ignore those
+   * for now.  Really we should add them as missing dependencies.
+   * See src/ext2_initrd.ml.
+   */
+  if (access (filename, R_OK) == 0) {
+    start_ns = get_time_ns ();
+    insmod (filename);
+    print_timing ("insmod", filename, start_ns);
+  }
+  else
+    fprintf (stderr, "skipped %s, module is missing\n", filename);
+}
+
 static void
 insmod (const char *filename)
 {
@@ -317,6 +518,8 @@ insmod (const char *filename)
   struct stat st;
   char *buf;
   size_t offset;
+  size_t len = strlen (filename);
+  int compressed;
 
   if (!quiet)
     fprintf (stderr, "supermin: internal insmod %s\n", filename);
@@ -326,6 +529,28 @@ insmod (const char *filename)
     fprintf (stderr, "insmod: open: %s: %m\n", filename);
     exit (EXIT_FAILURE);
   }
+
+  /* Let the kernel read the module from the file.  Modules are only
+   * left compressed in the initrd (with a .zst, .xz or .gz suffix)
+   * if the kernel can decompress them.
+   */
+  compressed = len < 3 || strcmp (filename + len - 3, ".ko") != 0;
+  if (do_finit_module (fd, "",
+                       compressed ? MODULE_INIT_COMPRESSED_FILE : 0) == 0) {
+    close (fd);
+    return;
+  }
+  if (errno != ENOSYS || compressed) {
+    fprintf (stderr, "insmod: finit_module: %s: %s\n",
+             filename, moderror (errno));
+    /* However ignore the error because this can just happen because
+     * of a missing device.
+     */
+    close (fd);
+    return;
+  }
+
+  /* Older kernels: read the module and use init_module. */
   if (fstat (fd, &st) == -1) {
     perror ("insmod: fstat");
     exit (EXIT_FAILURE);
@@ -553,6 +778,35 @@ hexdigit (char d)
   }
 }
 
+/* Block devices which find_fs_uuid has already read and found not to
+ * contain the root filesystem.  We are called again each time more
+ * devices appear, and with hundreds of disks reading every one of
+ * them each time would be slow.
+ */
+static dev_t *ruled_out = NULL;
+static size_t nr_ruled_out = 0;
+
+static int
+is_ruled_out (dev_t dev)
+{
+  size_t i;
+
+  for (i = 0; i < nr_ruled_out; ++i)
+    if (ruled_out[i] == dev)
+      return 1;
+  return 0;
+}
+
+static void
+rule_out (dev_t dev)
+{
+  dev_t *p = realloc (ruled_out, (nr_ruled_out+1) * sizeof (dev_t));
+  if (p == NULL)
+    return;                     /* we will just read it again */
+  ruled_out = p;
+  ruled_out[nr_ruled_out++] = dev;
+}
+
 /* Search every block device under /sys/block to see if we can find
  * one which contains a filesystem with the matching volume UUID.
  */
@@ -562,6 +816,7 @@ find_fs_uuid (const unsigned char *raw_uuid, int *major, int *minor)
   DIR *dir;
   struct dirent *d;
   unsigned char uuid[16];
+  dev_t dev;
 
   dir = opendir ("/sys/block");
   if (!dir) {
@@ -580,10 +835,13 @@ find_fs_uuid (const unsigned char *raw_uuid, int *major, int *minor)
 
     if (parse_dev_file (path, major, minor) == -1)
       goto cont;
+    dev = makedev (*major, *minor);
+    if (is_ruled_out (dev))
+      goto cont;
 
     /* We have to make a dummy inode so we can open the device. */
     unlink ("/dev/disk");
-    if (mknod ("/dev/disk", S_IFBLK|0700, makedev (*major, *minor)) == -1) {
+    if (mknod ("/dev/disk", S_IFBLK|0700, dev) == -1) {
       perror ("mknod");
       goto cont;
     }
@@ -599,8 +857,13 @@ find_fs_uuid (const unsigned char *raw_uuid, int *major, int *minor)
       goto cont;
     }
 
-    if (memcmp (uuid, raw_uuid, sizeof uuid) != 0)
+    if (memcmp (uuid, raw_uuid, sizeof uuid) != 0) {
+      /* Devices which are too small to read are not ruled out,
+       * since they may be media which has not been inserted yet.
+       */
+      rule_out (dev);
       goto cont;
+    }
 
     close (fd);
     free (path);
@@ -618,6 +881,35 @@ find_fs_uuid (const unsigned char *raw_uuid, int *major, int *minor)
   return -1;
 }
 
+/* Return the filesystem type to mount the root device as.  The
+ * appliance is ext2, unless it was built with -f ext4, which we can
+ * tell from the incompatible features in the superblock.
+ */
+static const char *
+root_fs_type (const char *dev)
+{
+  int fd;
+  unsigned char buf[4];
+  uint32_t incompat;
+  const uint32_t ext4_incompat = 0x0040 /* extents */ | 0x0200 /* flex_bg */;
+
+  fd = open (dev, O_RDONLY);
+  if (fd == -1) {
+    perror (dev);
+    return "ext2";
+  }
+  /* s_feature_incompat, little endian */
+  if (pread (fd, buf, sizeof buf, 0x460) != sizeof buf) {
+    perror ("pread");
+    close (fd);
+    return "ext2";
+  }
+  close (fd);
+
+  incompat = buf[0] | buf[1] << 8 | buf[2] << 16 | (uint32_t) buf[3] << 24;
+  return incompat & ext4_incompat ? "ext4" : "ext2";
+}
+
 /* Parse a /sys/block/X/dev file and extract the major:minor numbers. */
 static int
 parse_dev_file (const char *path, int *major, int *minor)
@@ -639,15 +931,21 @@ parse_dev_file (const char *path, int *major, int *minor)
   return 0;
 }
 
+/* Warn after waiting 1s for the root device, then each time the
+ * wait so far doubles.
+ */
 static void
-virtio_warning (uint64_t delay_ns, const char *what)
+virtio_warning (uint64_t waited_ns, const char *what)
 {
   static int virtio_message = 0;
+  static uint64_t next_warning_ns = 1000000000;
 
-  if (delay_ns > 1000000000) {
+  if (waited_ns >= next_warning_ns) {
     fprintf (stderr,
-             "supermin: waiting another %" PRIu64 " ns for %s to appear\n",
-             delay_ns, what);
+             "supermin: waited %" PRIu64 " ns for %s to appear\n",
+             waited_ns, what);
+    while (next_warning_ns <= waited_ns)
+      next_warning_ns *= 2;
 
     if (!virtio_message) {
       fprintf (stderr,
@@ -657,3 +955,138 @@ virtio_warning (uint64_t delay_ns, const char *what)
     }
   }
 }
+
+/* Time since boot, including any time the appliance was suspended,
+ * so it matches /proc/uptime.
+ */
+static uint64_t
+get_time_ns (void)
+{
+  struct timespec t;
+
+#ifdef CLOCK_BOOTTIME
+  clock_gettime (CLOCK_BOOTTIME, &t);
+#else
+  clock_gettime (CLOCK_MONOTONIC, &t);
+#endif
+  return t.tv_sec * UINT64_C(1000000000) + t.tv_nsec;
+}
+
+/* If timing is enabled, print a line for a step of the boot which
+ * started at start_ns and has just finished.  The format is:
+ *
+ *   supermin: timing: PHASE START DURATION [ARG]
+ *
+ * where START is the time since boot and DURATION is the time taken,
+ * both in seconds.
+ */
+static void
+print_timing (const char *phase, const char *arg, uint64_t start_ns)
+{
+  uint64_t duration_ns;
+
+  if (!timing)
+    return;
+
+  duration_ns = get_time_ns () - start_ns;
+  fprintf (stderr, "supermin: timing: %s"
+           " %" PRIu64 ".%06" PRIu64 " %" PRIu64 ".%06" PRIu64 "%s%s\n",
+           phase,
+           start_ns / 1000000000, start_ns % 1000000000 / 1000,
+           duration_ns / 1000000000, duration_ns % 1000000000 / 1000,
+           arg ? " " : "", arg ? arg : "");
+}
+
+/* Netlink socket receiving kernel uevents, or -1 if it could not be
+ * opened, in which case we fall back to polling the root device.
+ */
+static int uevent_fd = -1;
+
+static void
+open_uevent_socket (void)
+{
+  struct sockaddr_nl addr;
+
+  uevent_fd = socket (AF_NETLINK, SOCK_DGRAM|SOCK_CLOEXEC,
+                      NETLINK_KOBJECT_UEVENT);
+  if (uevent_fd == -1) {
+    perror ("socket: NETLINK_KOBJECT_UEVENT");
+    return;
+  }
+
+  memset (&addr, 0, sizeof addr);
+  addr.nl_family = AF_NETLINK;
+  addr.nl_groups = 1;           /* kernel uevents */
+  if (bind (uevent_fd, (struct sockaddr *) &addr, sizeof addr) == -1) {
+    perror ("bind: NETLINK_KOBJECT_UEVENT");
+    close (uevent_fd);
+    uevent_fd = -1;
+  }
+}
+
+static void
+close_uevent_socket (void)
+{
+  if (uevent_fd >= 0) {
+    close (uevent_fd);
+    uevent_fd = -1;
+  }
+}
+
+/* Is this uevent message (a header followed by NUL-separated
+ * KEY=VALUE strings) about a block device?
+ */
+static int
+is_block_uevent (const char *msg, size_t len)
+{
+  size_t i;
+
+  for (i = 0; i < len; i += strlen (msg + i) + 1) {
+    if (strcmp (msg + i, "SUBSYSTEM=block") == 0)
+      return 1;
+  }
+  return 0;
+}
+
+/* Wait until a block device is added or changed, or until delay_ns
+ * has passed, but not beyond deadline_ns.  Returns 1 if a block
+ * device uevent was received, or 0 on timeout.
+ */
+static int
+wait_for_block_device (uint64_t delay_ns, uint64_t deadline_ns)
+{
+  struct pollfd pfd;
+  char buf[4096];
+  ssize_t n;
+  int timeout_ms, found = 0;
+  uint64_t now_ns = get_time_ns ();
+
+  if (now_ns >= deadline_ns)
+    return 0;
+  if (delay_ns > deadline_ns - now_ns)
+    delay_ns = deadline_ns - now_ns;
+
+  if (uevent_fd == -1) {
+    struct timespec t;
+
+    t.tv_sec = delay_ns / 1000000000;
+    t.tv_nsec = delay_ns % 1000000000;
+    nanosleep (&t, NULL);
+    return 0;
+  }
+
+  timeout_ms = (delay_ns + 999999) / 1000000;
+  pfd.fd = uevent_fd;
+  pfd.events = POLLIN;
+  if (poll (&pfd, 1, timeout_ms) <= 0)
+    return 0;
+
+  /* Read all the pending uevents. */
+  while ((n = recv (uevent_fd, buf, sizeof buf - 1, MSG_DONTWAIT)) > 0) {
+    buf[n] = '\0';
+    if (is_block_uevent (buf, n))
+      found = 1;
+  }
+
+  return found;
+}
@@ -0,0 +1,337 @@
+/* supermin 5
+ * Copyright (C) 2009-2020 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Copy files in-process for the chroot format, instead of running
+ * 'cp -p' for each file.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <pthread.h>
+
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif
+
+#include <caml/alloc.h>
+#include <caml/fail.h>
+#include <caml/memory.h>
+#include <caml/mlvalues.h>
+#include <caml/signals.h>
+#include <caml/unixsupport.h>
+
+#define COPY_BUFFER_SIZE (128 * 1024)
+
+/* Copy the contents of 'sfd' to the empty file 'dfd'.  Returns 0, or
+ * -1 with errno set and the failing call in '*fn'.
+ */
+static int
+copy_data (int sfd, int dfd, const char **fn)
+{
+  char *buf;
+  ssize_t r, w, n;
+
+#ifdef FICLONE
+  /* If both files are on the same btrfs or XFS filesystem, share the
+   * blocks instead of copying them.
+   */
+  if (ioctl (dfd, FICLONE, sfd) == 0)
+    return 0;
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+  /* Otherwise let the kernel copy the data, which avoids copying it
+   * through userspace and may be offloaded by the filesystem.
+   */
+  n = 0;
+  for (;;) {
+    r = copy_file_range (sfd, NULL, dfd, NULL, 1 << 30, 0);
+    if (r == 0)
+      return 0;
+    if (r == -1) {
+      /* Not supported by this kernel or between these filesystems,
+       * so fall back to read and write below.
+       */
+      if (n == 0 &&
+          (errno == ENOSYS || errno == EXDEV || errno == EINVAL ||
+           errno == EOPNOTSUPP || errno == EBADF))
+        break;
+      *fn = "copy_file_range";
+      return -1;
+    }
+    n += r;
+  }
+#endif
+
+  buf = malloc (COPY_BUFFER_SIZE);
+  if (buf == NULL) {
+    *fn = "malloc";
+    return -1;
+  }
+  while ((r = read (sfd, buf, COPY_BUFFER_SIZE)) != 0) {
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      *fn = "read";
+      goto error;
+    }
+    for (n = 0; n < r; n += w) {
+      w = write (dfd, buf + n, r - n);
+      if (w == -1) {
+        if (errno == EINTR) {
+          w = 0;
+          continue;
+        }
+        *fn = "write";
+        goto error;
+      }
+    }
+  }
+  free (buf);
+  return 0;
+
+ error:
+  free (buf);
+  return -1;
+}
+
+/* Copy the regular file 'src' to 'dest', preserving the mode,
+ * ownership and timestamps like 'cp -p'.  Returns 0, or the errno
+ * with the failing call in '*fn'.
+ */
+static int
+copy_file (const char *src, const char *dest, const char **fn)
+{
+  struct stat statbuf;
+  struct timespec times[2];
+  int sfd, dfd = -1, err;
+
+  sfd = open (src, O_RDONLY|O_NOCTTY|O_CLOEXEC);
+  if (sfd == -1) {
+    *fn = "open";
+    return errno;
+  }
+  if (fstat (sfd, &statbuf) == -1) {
+    *fn = "fstat";
+    goto error;
+  }
+
+  dfd = open (dest, O_WRONLY|O_CREAT|O_TRUNC|O_NOCTTY|O_CLOEXEC, 0600);
+  if (dfd == -1) {
+    *fn = "open";
+    goto error;
+  }
+
+  if (copy_data (sfd, dfd, fn) == -1)
+    goto error;
+
+  /* Like 'cp -p', it is not an error if we cannot preserve the
+   * ownership (eg. when not running as root), but then the setuid
+   * and setgid bits are dropped.  The mode must be set after the
+   * ownership, since changing the owner clears those bits.
+   */
+  if (fchown (dfd, statbuf.st_uid, statbuf.st_gid) == -1)
+    statbuf.st_mode &= ~(S_ISUID|S_ISGID);
+  if (fchmod (dfd, statbuf.st_mode & 07777) == -1) {
+    *fn = "fchmod";
+    goto error;
+  }
+
+  times[0] = statbuf.st_atim;
+  times[1] = statbuf.st_mtim;
+  if (futimens (dfd, times) == -1) {
+    *fn = "futimens";
+    goto error;
+  }
+
+  err = close (dfd);
+  dfd = -1;
+  if (err == -1) {
+    *fn = "close";
+    goto error;
+  }
+  close (sfd);
+  return 0;
+
+ error:
+  err = errno;
+  if (dfd >= 0)
+    close (dfd);
+  close (sfd);
+  return err;
+}
+
+/* Hard link 'src' to 'dest', replacing 'dest' if it exists.  If the
+ * link cannot be made, for example because the files are on
+ * different filesystems or fs.protected_hardlinks forbids it, copy
+ * the file instead.
+ */
+static int
+link_file (const char *src, const char *dest, const char **fn)
+{
+  if (link (src, dest) == 0)
+    return 0;
+  if (errno == EEXIST && unlink (dest) == 0 && link (src, dest) == 0)
+    return 0;
+
+  return copy_file (src, dest, fn);
+}
+
+/* A list of files shared by the copying threads.  Each thread takes
+ * the next file not yet copied, so the work is balanced however the
+ * file sizes vary.
+ */
+struct copy_job {
+  char *src, *dest;
+  const char *fn;               /* failing call, if err != 0 */
+  int err;
+};
+
+struct copy_pool {
+  pthread_mutex_t lock;
+  struct copy_job *jobs;
+  size_t nr_jobs;
+  size_t next;                  /* next job to take, protected by lock */
+  int link;                     /* hard link the files if possible */
+};
+
+static void *
+copy_thread (void *poolv)
+{
+  struct copy_pool *pool = poolv;
+  struct copy_job *job;
+
+  for (;;) {
+    pthread_mutex_lock (&pool->lock);
+    if (pool->next >= pool->nr_jobs) {
+      pthread_mutex_unlock (&pool->lock);
+      break;
+    }
+    job = &pool->jobs[pool->next++];
+    pthread_mutex_unlock (&pool->lock);
+
+    if (pool->link)
+      job->err = link_file (job->src, job->dest, &job->fn);
+    else
+      job->err = copy_file (job->src, job->dest, &job->fn);
+  }
+
+  return NULL;
+}
+
+value
+supermin_copy_file (value srcv, value destv)
+{
+  CAMLparam2 (srcv, destv);
+  const char *fn = NULL;
+  int err;
+
+  err = copy_file (String_val (srcv), String_val (destv), &fn);
+  if (err != 0)
+    unix_error (err, (char *) fn, srcv);
+
+  CAMLreturn (Val_unit);
+}
+
+/* Copy the list of (src, dest) regular files using 'jobs' threads,
+ * including this one.  The files must be independent of each other.
+ * If 'link' is true, the files are hard linked where possible.
+ * Returns the list of (index, function, error) for the files which
+ * could not be copied, in order.
+ */
+value
+supermin_copy_files (value jobsv, value linkv, value filesv)
+{
+  CAMLparam3 (jobsv, linkv, filesv);
+  CAMLlocal3 (rv, v, errv);
+  int jobs = Int_val (jobsv);
+  struct copy_pool pool;
+  pthread_t *threads = NULL;
+  size_t i, n, nr_threads = 0;
+
+  /* The copying threads cannot access the OCaml heap, so take a copy
+   * of the list.
+   */
+  for (n = 0, v = filesv; v != Val_int (0); v = Field (v, 1))
+    n++;
+  if (n == 0)
+    CAMLreturn (Val_int (0));
+  memset (&pool, 0, sizeof pool);
+  pool.jobs = calloc (n, sizeof (struct copy_job));
+  if (pool.jobs == NULL)
+    caml_raise_out_of_memory ();
+  pool.nr_jobs = n;
+  pool.link = Bool_val (linkv);
+  for (i = 0, v = filesv; v != Val_int (0); i++, v = Field (v, 1)) {
+    pool.jobs[i].src = strdup (String_val (Field (Field (v, 0), 0)));
+    pool.jobs[i].dest = strdup (String_val (Field (Field (v, 0), 1)));
+    if (pool.jobs[i].src == NULL || pool.jobs[i].dest == NULL)
+      caml_raise_out_of_memory ();
+  }
+  pthread_mutex_init (&pool.lock, NULL);
+
+  if (jobs > 1) {
+    if ((size_t) jobs > n)
+      jobs = n;
+    threads = malloc ((jobs-1) * sizeof (pthread_t));
+    if (threads == NULL)
+      caml_raise_out_of_memory ();
+  }
+
+  caml_enter_blocking_section ();
+  /* If a thread cannot be created, the others do its share. */
+  for (i = 1; i < (size_t) jobs; ++i) {
+    if (pthread_create (&threads[nr_threads], NULL, copy_thread, &pool) != 0)
+      break;
+    nr_threads++;
+  }
+  copy_thread (&pool);
+  for (i = 0; i < nr_threads; ++i)
+    pthread_join (threads[i], NULL);
+  caml_leave_blocking_section ();
+
+  free (threads);
+  pthread_mutex_destroy (&pool.lock);
+
+  rv = Val_int (0);
+  for (i = n; i-- > 0; ) {
+    if (pool.jobs[i].err != 0) {
+      errv = caml_alloc_tuple (3);
+      Store_field (errv, 0, Val_long (i));
+      Store_field (errv, 1, caml_copy_string (pool.jobs[i].fn));
+      Store_field (errv, 2, unix_error_of_code (pool.jobs[i].err));
+      v = caml_alloc (2, 0);
+      Store_field (v, 0, errv);
+      Store_field (v, 1, rv);
+      rv = v;
+    }
+    free (pool.jobs[i].src);
+    free (pool.jobs[i].dest);
+  }
+  free (pool.jobs);
+
+  CAMLreturn (rv);
+}
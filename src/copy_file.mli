@@ -0,0 +1,36 @@
+(* supermin 5
+ * Copyright (C) 2009-2020 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *)
+
+val copy_file : string -> string -> unit
+(** [copy_file src dest] copies the regular file [src] to [dest],
+    preserving the mode, ownership and timestamps like [cp -p].
+
+    The data is reflinked if possible, else copied using
+    [copy_file_range] or [read] and [write].  Raises [Unix_error]
+    on failure. *)
+
+val copy_files : int -> bool -> (string * string) list -> (int * string * Unix.error) list
+(** [copy_files jobs link files] copies each [(src, dest)] in the list
+    [files] as {!copy_file}, using [jobs] threads.  No [dest] may
+    be the same as another, or be affected by copying another.
+
+    If [link] is true, each [dest] is made a hard link to [src]
+    instead, falling back to copying if that is not possible.
+
+    Returns [(i, function, error)] for each file which could not be
+    copied, where [i] is its index in [files]. *)
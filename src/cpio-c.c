@@ -0,0 +1,441 @@
+/* supermin 5
+ * Copyright (C) 2009-2020 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Write the initrd as a "newc" format cpio archive, decompressing
+ * kernel modules on the fly, instead of unpacking the modules into a
+ * temporary directory and running cpio(1).
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_LIBLZMA
+#include <lzma.h>
+#endif
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+#include <caml/alloc.h>
+#include <caml/fail.h>
+#include <caml/memory.h>
+#include <caml/mlvalues.h>
+#include <caml/unixsupport.h>
+
+#define CPIO_BUFFER_SIZE (128 * 1024)
+
+/* Offset of the c_filesize field in the header. */
+#define CPIO_FILESIZE_OFFSET 54
+
+/* Input buffer and output buffer for decompression. */
+struct cpio_buffers {
+  char in[CPIO_BUFFER_SIZE];
+  char out[CPIO_BUFFER_SIZE];
+};
+
+struct cpio {
+  int fd;
+  char *filename;               /* the archive */
+  off_t offset;                 /* current length of the archive */
+  uint32_t ino;                 /* last inode number used */
+  struct cpio_buffers *b;
+  int src_fd;                   /* host file being copied, or -1 */
+  char *src;
+};
+
+static void cpio_oom (struct cpio *cpio) __attribute__((noreturn));
+static void cpio_unix_error (struct cpio *cpio, int err, const char *fn, const char *filename) __attribute__((noreturn));
+static void cpio_decompress_error (struct cpio *cpio, const char *fn, const char *filename, const char *msg) __attribute__((noreturn));
+
+/* Free everything and remove the partial archive, before raising an
+ * exception.
+ */
+static void
+cpio_abort (struct cpio *cpio)
+{
+  if (cpio->src_fd >= 0)
+    close (cpio->src_fd);
+  free (cpio->src);
+  if (cpio->fd >= 0) {
+    close (cpio->fd);
+    unlink (cpio->filename);
+  }
+  free (cpio->filename);
+  free (cpio->b);
+}
+
+static void
+cpio_oom (struct cpio *cpio)
+{
+  cpio_abort (cpio);
+  caml_raise_out_of_memory ();
+}
+
+static void
+cpio_unix_error (struct cpio *cpio, int err, const char *fn,
+                 const char *filename)
+{
+  /* Copy the name first, since it may be freed by cpio_abort. */
+  value filenamev = caml_copy_string (filename);
+
+  cpio_abort (cpio);
+  unix_error (err, (char *) fn, filenamev);
+}
+
+static void
+cpio_decompress_error (struct cpio *cpio, const char *fn, const char *filename,
+                       const char *msg)
+{
+  fprintf (stderr, "supermin: %s: %s: %s\n", fn, filename, msg);
+  cpio_abort (cpio);
+  caml_failwith (fn);
+}
+
+static void
+cpio_write (struct cpio *cpio, const void *buf, size_t len)
+{
+  const char *p = buf;
+  ssize_t r;
+
+  while (len > 0) {
+    r = write (cpio->fd, p, len);
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      cpio_unix_error (cpio, errno, "write", cpio->filename);
+    }
+    p += r;
+    len -= r;
+    cpio->offset += r;
+  }
+}
+
+/* Pad the archive to a multiple of 4 bytes. */
+static void
+cpio_pad (struct cpio *cpio)
+{
+  static const char zeroes[4];
+
+  if (cpio->offset & 3)
+    cpio_write (cpio, zeroes, 4 - (cpio->offset & 3));
+}
+
+/* Write the header and name of an entry, returning the offset of the
+ * header.  All entries are owned by root, with no timestamp, so the
+ * archive only depends on the content.
+ */
+static off_t
+cpio_header (struct cpio *cpio, const char *name, uint32_t mode,
+             uint32_t nlink, size_t size)
+{
+  char header[111];
+  off_t offset = cpio->offset;
+  size_t namesize = strlen (name) + 1;
+
+  snprintf (header, sizeof header,
+            "070701"
+            "%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X",
+            mode == 0 ? 0 : ++cpio->ino, mode, 0, 0, nlink, 0,
+            (unsigned) size, 0, 0, 0, 0, (unsigned) namesize, 0);
+  cpio_write (cpio, header, 110);
+  cpio_write (cpio, name, namesize);
+  cpio_pad (cpio);
+  return offset;
+}
+
+/* Fix up the size in the header at 'offset', after the data has been
+ * written.
+ */
+static void
+cpio_set_size (struct cpio *cpio, off_t offset, size_t size)
+{
+  char buf[9];
+
+  snprintf (buf, sizeof buf, "%08X", (unsigned) size);
+  if (pwrite (cpio->fd, buf, 8, offset + CPIO_FILESIZE_OFFSET) != 8)
+    cpio_unix_error (cpio, errno, "pwrite", cpio->filename);
+}
+
+static ssize_t
+cpio_read (struct cpio *cpio, int fd, void *buf, size_t len,
+           const char *filename)
+{
+  ssize_t r;
+
+  do
+    r = read (fd, buf, len);
+  while (r == -1 && errno == EINTR);
+  if (r == -1)
+    cpio_unix_error (cpio, errno, "read", filename);
+  return r;
+}
+
+static int
+has_suffix (const char *filename, const char *suffix)
+{
+  size_t n = strlen (filename), m = strlen (suffix);
+
+  return n >= m && strcmp (filename + n - m, suffix) == 0;
+}
+
+/* Copy the contents of 'fd' into the archive, decompressing it if
+ * 'decompress' is true and 'filename' has a suffix we can
+ * decompress.  Returns the size written.
+ */
+static size_t
+cpio_copy (struct cpio *cpio, int fd, const char *filename, int decompress,
+           struct cpio_buffers *b)
+{
+  size_t size = 0;
+  ssize_t n;
+
+  if (!decompress)
+    goto copy;
+
+#ifdef HAVE_LIBZSTD
+  if (has_suffix (filename, ".zst")) {
+    ZSTD_DStream *ds = ZSTD_createDStream ();
+    ZSTD_inBuffer in;
+    ZSTD_outBuffer out;
+    size_t r = 1;
+
+    if (ds == NULL)
+      cpio_oom (cpio);
+    ZSTD_initDStream (ds);
+    while ((n = cpio_read (cpio, fd, b->in, sizeof b->in, filename)) > 0) {
+      in.src = b->in;
+      in.size = n;
+      in.pos = 0;
+      do {
+        out.dst = b->out;
+        out.size = sizeof b->out;
+        out.pos = 0;
+        r = ZSTD_decompressStream (ds, &out, &in);
+        if (ZSTD_isError (r)) {
+          ZSTD_freeDStream (ds);
+          cpio_decompress_error (cpio, "ZSTD_decompressStream", filename,
+                                 ZSTD_getErrorName (r));
+        }
+        cpio_write (cpio, b->out, out.pos);
+        size += out.pos;
+      } while (in.pos < in.size || out.pos == out.size);
+    }
+    ZSTD_freeDStream (ds);
+    /* ZSTD_decompressStream returns 0 when a frame is complete. */
+    if (r != 0)
+      cpio_decompress_error (cpio, "ZSTD_decompressStream", filename,
+                             "truncated zstd data");
+    return size;
+  }
+#endif
+
+#ifdef HAVE_LIBLZMA
+  if (has_suffix (filename, ".xz")) {
+    lzma_stream s = LZMA_STREAM_INIT;
+    lzma_action action = LZMA_RUN;
+    lzma_ret r;
+
+    r = lzma_stream_decoder (&s, UINT64_MAX, LZMA_CONCATENATED);
+    if (r != LZMA_OK)
+      cpio_decompress_error (cpio, "lzma_stream_decoder", filename,
+                             "could not initialize decoder");
+    do {
+      if (s.avail_in == 0 && action == LZMA_RUN) {
+        n = cpio_read (cpio, fd, b->in, sizeof b->in, filename);
+        s.next_in = (const uint8_t *) b->in;
+        s.avail_in = n;
+        if (n == 0)
+          action = LZMA_FINISH;
+      }
+      s.next_out = (uint8_t *) b->out;
+      s.avail_out = sizeof b->out;
+      r = lzma_code (&s, action);
+      if (r != LZMA_OK && r != LZMA_STREAM_END) {
+        lzma_end (&s);
+        cpio_decompress_error (cpio, "lzma_code", filename,
+                               "corrupt xz data");
+      }
+      cpio_write (cpio, b->out, sizeof b->out - s.avail_out);
+      size += sizeof b->out - s.avail_out;
+    } while (r != LZMA_STREAM_END);
+    lzma_end (&s);
+    return size;
+  }
+#endif
+
+#ifdef HAVE_ZLIB
+  if (has_suffix (filename, ".gz")) {
+    z_stream s;
+    int r = Z_OK;
+
+    memset (&s, 0, sizeof s);
+    /* 32 means detect the gzip header. */
+    if (inflateInit2 (&s, 15 + 32) != Z_OK)
+      cpio_decompress_error (cpio, "inflateInit2", filename,
+                             "could not initialize decoder");
+    while (r != Z_STREAM_END &&
+           (n = cpio_read (cpio, fd, b->in, sizeof b->in, filename)) > 0) {
+      s.next_in = (Bytef *) b->in;
+      s.avail_in = n;
+      do {
+        s.next_out = (Bytef *) b->out;
+        s.avail_out = sizeof b->out;
+        r = inflate (&s, Z_NO_FLUSH);
+        if (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR) {
+          inflateEnd (&s);
+          cpio_decompress_error (cpio, "inflate", filename,
+                                 s.msg ? s.msg : "corrupt gzip data");
+        }
+        cpio_write (cpio, b->out, sizeof b->out - s.avail_out);
+        size += sizeof b->out - s.avail_out;
+      } while (s.avail_out == 0 && r != Z_STREAM_END);
+    }
+    inflateEnd (&s);
+    if (r != Z_STREAM_END)
+      cpio_decompress_error (cpio, "inflate", filename,
+                             "truncated gzip data");
+    return size;
+  }
+#endif
+
+ copy:
+  while ((n = cpio_read (cpio, fd, b->in, sizeof b->in, filename)) > 0) {
+    cpio_write (cpio, b->in, n);
+    size += n;
+  }
+  return size;
+}
+
+/* Can 'filename' be decompressed in-process? */
+value
+supermin_cpio_can_decompress (value filenamev)
+{
+  CAMLparam1 (filenamev);
+  const char *filename = String_val (filenamev);
+  int r = 0;
+
+#ifdef HAVE_LIBZSTD
+  r |= has_suffix (filename, ".zst");
+#endif
+#ifdef HAVE_LIBLZMA
+  r |= has_suffix (filename, ".xz");
+#endif
+#ifdef HAVE_ZLIB
+  r |= has_suffix (filename, ".gz");
+#endif
+  (void) filename;
+
+  CAMLreturn (Val_bool (r));
+}
+
+/* Write the list of entries to the archive 'filename'.  See
+ * cpio.mli for the type of entries.
+ */
+value
+supermin_cpio_write (value filenamev, value entriesv)
+{
+  CAMLparam2 (filenamev, entriesv);
+  CAMLlocal2 (v, entryv);
+  struct cpio cpio;
+  const char *name;
+  uint32_t mode;
+  off_t offset;
+  size_t size;
+
+  /* Strings on the OCaml heap may move when the error paths below
+   * allocate, so take copies of the filenames.  Everything is freed,
+   * and the partial archive removed, if there is an error.
+   */
+  memset (&cpio, 0, sizeof cpio);
+  cpio.fd = -1;
+  cpio.src_fd = -1;
+  cpio.filename = strdup (String_val (filenamev));
+  cpio.b = malloc (sizeof *cpio.b);
+  if (cpio.filename == NULL || cpio.b == NULL)
+    cpio_oom (&cpio);
+  cpio.fd = open (cpio.filename,
+                  O_WRONLY|O_CREAT|O_TRUNC|O_NOCTTY|O_CLOEXEC, 0644);
+  if (cpio.fd == -1)
+    cpio_unix_error (&cpio, errno, "open", cpio.filename);
+
+  for (v = entriesv; v != Val_int (0); v = Field (v, 1)) {
+    entryv = Field (v, 0);
+    name = String_val (Field (entryv, 0));
+    mode = Int_val (Field (entryv, 1));
+
+    switch (Tag_val (entryv)) {
+    case 0:                     /* Directory */
+      cpio_header (&cpio, name, S_IFDIR | mode, 2, 0);
+      break;
+
+    case 1:                     /* File */
+      size = caml_string_length (Field (entryv, 2));
+      cpio_header (&cpio, name, S_IFREG | mode, 1, size);
+      cpio_write (&cpio, String_val (Field (entryv, 2)), size);
+      cpio_pad (&cpio);
+      break;
+
+    case 2:                     /* Host_file */
+      cpio.src = strdup (String_val (Field (entryv, 2)));
+      if (cpio.src == NULL)
+        cpio_oom (&cpio);
+      cpio.src_fd = open (cpio.src, O_RDONLY|O_NOCTTY|O_CLOEXEC);
+      if (cpio.src_fd == -1)
+        cpio_unix_error (&cpio, errno, "open", cpio.src);
+      /* The size isn't known until the file has been decompressed. */
+      offset = cpio_header (&cpio, name, S_IFREG | mode, 1, 0);
+      size = cpio_copy (&cpio, cpio.src_fd, cpio.src,
+                        Bool_val (Field (entryv, 3)), cpio.b);
+      close (cpio.src_fd);
+      cpio.src_fd = -1;
+      free (cpio.src);
+      cpio.src = NULL;
+      cpio_set_size (&cpio, offset, size);
+      cpio_pad (&cpio);
+      break;
+
+    default:
+      abort ();
+    }
+  }
+
+  cpio_header (&cpio, "TRAILER!!!", 0, 1, 0);
+
+  if (close (cpio.fd) == -1) {
+    int err = errno;
+    cpio.fd = -1;
+    unlink (cpio.filename);
+    cpio_unix_error (&cpio, err, "close", cpio.filename);
+  }
+  free (cpio.b);
+  free (cpio.filename);
+
+  CAMLreturn (Val_unit);
+}
@@ -0,0 +1,25 @@
+(* supermin 5
+ * Copyright (C) 2009-2020 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *)
+
+type entry =
+  | Directory of string * Unix.file_perm
+  | File of string * Unix.file_perm * string
+  | Host_file of string * Unix.file_perm * string * bool
+
+external cpio_write : string -> entry list -> unit = "supermin_cpio_write"
+external cpio_can_decompress : string -> bool = "supermin_cpio_can_decompress"
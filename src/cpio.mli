@@ -0,0 +1,39 @@
+(* supermin 5
+ * Copyright (C) 2009-2020 Red Hat Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ *)
+
+(** Write cpio archives, for the initrd. *)
+
+type entry =
+  | Directory of string * Unix.file_perm    (** name, permissions *)
+  | File of string * Unix.file_perm * string
+  (** name, permissions, contents *)
+  | Host_file of string * Unix.file_perm * string * bool
+  (** name, permissions, file on the host, decompress.  If
+      decompress is true, the host file is compressed and
+      {!cpio_can_decompress} is true for it, it is decompressed as
+      it is written. *)
+
+val cpio_write : string -> entry list -> unit
+(** [cpio_write filename entries] writes a "newc" format cpio archive
+    (as used for the Linux initramfs) containing [entries].  All
+    entries are owned by root and have no timestamp. *)
+
+val cpio_can_decompress : string -> bool
+(** [cpio_can_decompress filename] returns true if [filename] has a
+    [.zst], [.xz] or [.gz] suffix and supermin was built with the
+    library to decompress it. *)
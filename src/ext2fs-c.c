@@ -33,6 +33,8 @@
 #include <assert.h>
 #include <inttypes.h>
 #include <fts.h>
+#include <search.h>
+#include <pthread.h>
 
 #if MAJOR_IN_MKDEV
 #include <sys/mkdev.h>
@@ -61,10 +63,140 @@
 /* How many blocks of size S are needed for storing N bytes. */
 #define ROUND_UP(N, S) (((N) + (S) - 1) / (S))
 
+/* Regular files that have already been copied from the host.  These
+ * are used to preserve hard links (host files with the same st_dev
+ * and st_ino share one inode in the filesystem) and, if the 'dedup'
+ * flag is set, to share one inode between host files which have
+ * identical content and the same mode and ownership.
+ */
+struct ext2_copied_file
+{
+  dev_t dev;                    /* host st_dev, st_ino */
+  ino_t host_ino;
+  off_t size;                   /* content key, only used for dedup */
+  uint64_t hash;
+  int hashed;                   /* in 'sizes', the file was hashed */
+  mode_t mode;
+  uid_t uid;
+  gid_t gid;
+  char *src;                    /* host path, for comparing content */
+  ext2_ino_t ino;               /* inode, or 0 if it has been freed */
+};
+
+/* Parent directories that have already been looked up.  Resolving
+ * a directory name requires canonicalizing it on the host (if it is
+ * a symlink to a directory) and then a lookup from the root of the
+ * filesystem, so we only want to do this once per directory.
+ */
+struct ext2_cached_dir
+{
+  char *path;
+  char *target;                 /* canonical host path if path is a
+                                   symlink to a directory, else NULL */
+  ext2_ino_t ino;               /* inode in the filesystem, or 0 if
+                                   it has not been looked up yet */
+  size_t presize;               /* bytes of directory entries expected
+                                   when the directory is created */
+};
+
+/* Directories in the filesystem.  ext2fs_link and ext2fs_lookup scan
+ * every block of the directory, which is quadratic when thousands of
+ * files are copied into one directory.  Instead we keep the names in
+ * each directory in memory, and append new entries to the block that
+ * we are currently filling.  Directories larger than one block are
+ * converted to hashed (htree) directories when the filesystem is
+ * closed, if it has the dir_index feature.
+ */
+struct ext2_name
+{
+  char *name;
+  ext2_ino_t ino;
+  int dir_ft;
+};
+
+struct ext2_dir
+{
+  ext2_ino_t ino;
+  ext2_ino_t parent;
+  void *names;                  /* tsearch tree of struct ext2_name */
+  size_t nr_names;
+  blk64_t nr_blocks;            /* size of the directory in blocks */
+  blk64_t cur_lblk;             /* block new entries are added to */
+  struct ext2_dir *next;        /* list of all directories */
+};
+
+/* Host files are read ahead by a pool of reader threads, so that
+ * host I/O overlaps with updating the filesystem (libext2fs is not
+ * thread safe, so only the main thread touches the filesystem).
+ * Readers claim files in list order and store the result in a ring
+ * of slots, which the main thread consumes in the same order.  The
+ * filesystem is therefore built exactly as if the files were read
+ * serially.
+ */
+struct ext2_prefetched_file
+{
+  int ready;                    /* set when a reader has finished */
+  int lstat_errno;              /* errno if lstat failed */
+  struct stat statbuf;
+  int open_errno;               /* errno if the file was unreadable */
+  char *content;                /* regular file content or symlink
+                                   target, or NULL if not read ahead */
+  size_t size;                  /* size of content */
+};
+
+struct ext2_prefetch
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;          /* broadcast on every state change */
+  pthread_t *threads;
+  size_t nr_threads;
+  char **srcs;                  /* host files, in the order copied */
+  size_t nr_srcs;
+  struct ext2_prefetched_file *ring;
+  size_t ring_size;
+  size_t next_read;             /* next index to be claimed by a reader */
+  size_t next_write;            /* next index to be used by the writer */
+  int holding;                  /* writer is using slot 'next_write' */
+  size_t buffered;              /* bytes of content held in the ring */
+  int stop;
+};
+
+/* Files listed by --layout-trace, which are placed at the start of
+ * the filesystem in the order they are read at boot.  Their blocks
+ * are reserved up front (marked as in use in the block bitmap), and
+ * each file's blocks are released again just before the file is
+ * written, so that ext2fs_fallocate puts it there.
+ */
+struct ext2_layout_file
+{
+  char *path;
+  blk64_t start;                /* first block reserved for the file */
+  blk64_t end;                  /* block after the last one */
+};
+
+struct ext2_cache
+{
+  void *hard_links;             /* tsearch tree keyed on dev, host_ino */
+  void *contents;               /* tsearch tree keyed on content */
+  void *sizes;                  /* tsearch tree keyed on size, mode,
+                                   uid, gid: the first such file */
+  void *dirs;                   /* tsearch tree keyed on path */
+  void *fs_dirs;                /* tsearch tree of struct ext2_dir */
+  struct ext2_dir *fs_dir_list;
+  void *layout;                 /* tsearch tree of struct ext2_layout_file */
+  ext2fs_block_bitmap layout_blocks; /* blocks still reserved, or NULL */
+  blk64_t layout_end;           /* block after the last one reserved */
+  struct ext2_prefetch *prefetch; /* reader threads, or NULL */
+  uint64_t inodes_saved;
+  uint64_t bytes_saved;
+};
+
 struct ext2_data
 {
   ext2_filsys fs;
   int debug;
+  int dedup;
+  struct ext2_cache *cache;
 };
 
 static void initialize (void) __attribute__((constructor));
@@ -101,17 +233,26 @@ ext2_handle_closed (void)
 #define Some_val(v) Field(v,0)
 #endif
 
+static void ext2_cache_free (struct ext2_cache *cache);
+static void ext2_prefetch_stop (struct ext2_cache *cache);
+static void ext2_index_dirs (struct ext2_data *data);
+static blk64_t ext2_layout_claim (struct ext2_data *data, const char *path);
+static void ext2_layout_release (struct ext2_cache *cache, ext2_filsys fs);
+
 static void
 ext2_finalize (value fsv)
 {
   struct ext2_data data = Ext2fs_val (fsv);
 
   if (data.fs) {
+    /* Don't leave any blocks reserved which weren't used. */
+    ext2_layout_release (data.cache, data.fs);
 #ifdef HAVE_EXT2FS_CLOSE2
     ext2fs_close2 (data.fs, EXT2_FLAG_FLUSH_NO_SYNC);
 #else
     ext2fs_close (data.fs);
 #endif
+    ext2_cache_free (data.cache);
   }
 }
 
@@ -136,10 +277,24 @@ Val_ext2fs (struct ext2_data *data)
   CAMLreturn (fsv);
 }
 
+/* Set the remaining fields of 'data' after the filesystem has been
+ * opened or created.
+ */
+static void
+init_ext2_data (struct ext2_data *data, value debugv, value dedupv)
+{
+  data->debug = debugv == Val_none ? 0 : Int_val (Some_val (debugv));
+  data->dedup = dedupv == Val_none ? 0 : Bool_val (Some_val (dedupv));
+
+  data->cache = calloc (1, sizeof (struct ext2_cache));
+  if (data->cache == NULL)
+    caml_raise_out_of_memory ();
+}
+
 value
-supermin_ext2fs_open (value filev, value debugv)
+supermin_ext2fs_open (value filev, value debugv, value dedupv)
 {
-  CAMLparam1 (filev);
+  CAMLparam3 (filev, debugv, dedupv);
   CAMLlocal1 (fsv);
   int fs_flags = EXT2_FLAG_RW;
   errcode_t err;
@@ -154,21 +309,229 @@ supermin_ext2fs_open (value filev, value debugv)
   if (err != 0)
     ext2_error_to_exception ("ext2fs_open", err, String_val (filev));
 
-  data.debug = debugv == Val_none ? 0 : Int_val (Some_val (debugv));
+  init_ext2_data (&data, debugv, dedupv);
+
+  fsv = Val_ext2fs (&data);
+  CAMLreturn (fsv);
+}
+
+/* Geometry of filesystems created by supermin_ext2fs_create.  The
+ * defaults are the same as mke2fs uses for ext2 filesystems larger
+ * than 512 MB.
+ */
+#define CREATE_BLOCK_SIZE 4096
+#define CREATE_INODE_SIZE 256
+#define CREATE_INODE_RATIO 16384
+
+/* mke2fs makes lost+found this big so that e2fsck doesn't need to
+ * allocate blocks in it.
+ */
+#define LOST_AND_FOUND_SIZE 16384
+
+static ssize_t full_read (int fd, void *buf, size_t n);
+
+/* Random bytes for the filesystem UUID and directory hash seed. */
+static void
+random_bytes (void *buf, size_t n)
+{
+  int fd;
+  size_t i;
+
+  fd = open ("/dev/urandom", O_RDONLY|O_CLOEXEC);
+  if (fd >= 0) {
+    ssize_t r = full_read (fd, buf, n);
+    close (fd);
+    if (r == (ssize_t) n)
+      return;
+  }
+
+  for (i = 0; i < n; ++i)
+    ((unsigned char *) buf)[i] = random ();
+}
+
+/* Number of block groups packed together with flex_bg (ext4 only),
+ * as a power of 2.  This is the mke2fs default of 16.
+ */
+#define CREATE_LOG_GROUPS_PER_FLEX 4
+
+/* Create a new, empty filesystem of 'sizev' bytes in the file
+ * 'filev', which must be a newly created (hence zero-filled) file of
+ * at least that size.  This does the same as mke2fs, except that the
+ * inode tables are not zeroed, and the bitmaps and group descriptors
+ * are only written out when the handle is closed.  If 'inodesv' is 0
+ * then the number of inodes is chosen from the size.  'reservedv' is
+ * the percentage of blocks reserved for root.
+ *
+ * If 'ext4v' is true, then the filesystem is ext4 without a journal
+ * (extents, flex_bg, huge_file and dir_index features), and regular
+ * files created later use extents.
+ */
+value
+supermin_ext2fs_create_native (value filev, value sizev, value inodesv,
+                               value reservedv, value ext4v,
+                               value debugv, value dedupv)
+{
+  CAMLparam5 (filev, sizev, inodesv, reservedv, ext4v);
+  CAMLxparam2 (debugv, dedupv);
+  CAMLlocal1 (fsv);
+  const char *filename = String_val (filev);
+  uint64_t size = Int64_val (sizev);
+  uint64_t inodes = Int64_val (inodesv);
+  int reserved = Int_val (reservedv);
+  int fs_flags = EXT2_FLAG_RW;
+  errcode_t err;
+  struct ext2_data data;
+  struct ext2_super_block param;
+  struct ext2_inode inode;
+  blk64_t blocks;
+  ext2_ino_t ino;
+
+#ifdef EXT2_FLAG_64BITS
+  fs_flags |= EXT2_FLAG_64BITS;
+#endif
+
+  blocks = size / CREATE_BLOCK_SIZE;
+  if (inodes == 0)
+    inodes = size / CREATE_INODE_RATIO;
+  if (inodes > UINT32_MAX)
+    inodes = UINT32_MAX;
+
+  memset (&param, 0, sizeof param);
+  param.s_rev_level = EXT2_DYNAMIC_REV;
+  param.s_log_block_size = 2;   /* 1024 << 2 == CREATE_BLOCK_SIZE */
+  ext2fs_blocks_count_set (&param, blocks);
+  ext2fs_r_blocks_count_set (&param, blocks * reserved / 100);
+  param.s_inodes_count = inodes;
+  param.s_inode_size = CREATE_INODE_SIZE;
+  param.s_feature_compat = EXT2_FEATURE_COMPAT_EXT_ATTR;
+  param.s_feature_incompat = EXT2_FEATURE_INCOMPAT_FILETYPE;
+  param.s_feature_ro_compat =
+    EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER | EXT2_FEATURE_RO_COMPAT_LARGE_FILE;
+  if (Bool_val (ext4v)) {
+    param.s_feature_compat |= EXT2_FEATURE_COMPAT_DIR_INDEX;
+    param.s_feature_incompat |=
+      EXT3_FEATURE_INCOMPAT_EXTENTS | EXT4_FEATURE_INCOMPAT_FLEX_BG;
+    param.s_feature_ro_compat |=
+      EXT4_FEATURE_RO_COMPAT_HUGE_FILE | EXT4_FEATURE_RO_COMPAT_DIR_NLINK |
+      EXT4_FEATURE_RO_COMPAT_EXTRA_ISIZE;
+    param.s_log_groups_per_flex = CREATE_LOG_GROUPS_PER_FLEX;
+    param.s_min_extra_isize = param.s_want_extra_isize =
+      sizeof (struct ext2_inode_large) - EXT2_GOOD_OLD_INODE_SIZE;
+  }
+
+  err = ext2fs_initialize (filename, fs_flags, &param,
+                           unix_io_manager, &data.fs);
+  if (err != 0)
+    ext2_error_to_exception ("ext2fs_initialize", err, filename);
+
+  random_bytes (data.fs->super->s_uuid, sizeof data.fs->super->s_uuid);
+  /* Make it a version 4 (random) UUID. */
+  data.fs->super->s_uuid[6] = (data.fs->super->s_uuid[6] & 0x0f) | 0x40;
+  data.fs->super->s_uuid[8] = (data.fs->super->s_uuid[8] & 0x3f) | 0x80;
+  random_bytes (data.fs->super->s_hash_seed,
+                sizeof data.fs->super->s_hash_seed);
+  data.fs->super->s_def_hash_version = EXT2_HASH_HALF_MD4;
+  /* Directory hashes depend on the signedness of char, so record it
+   * in the superblock like mke2fs does.
+   */
+  if ((int) (char) 255 == -1)
+    data.fs->super->s_flags |= EXT2_FLAGS_SIGNED_HASH;
+  else
+    data.fs->super->s_flags |= EXT2_FLAGS_UNSIGNED_HASH;
+  data.fs->super->s_max_mnt_count = -1;
+
+  err = ext2fs_allocate_tables (data.fs);
+  if (err != 0)
+    ext2_error_to_exception ("ext2fs_allocate_tables", err, filename);
+
+  /* Root directory and lost+found. */
+  err = ext2fs_mkdir (data.fs, EXT2_ROOT_INO, EXT2_ROOT_INO, 0);
+  if (err != 0)
+    ext2_error_to_exception ("ext2fs_mkdir", err, "/");
+  err = ext2fs_mkdir (data.fs, EXT2_ROOT_INO, 0, "lost+found");
+  if (err != 0)
+    ext2_error_to_exception ("ext2fs_mkdir", err, "/lost+found");
+  err = ext2fs_lookup (data.fs, EXT2_ROOT_INO, "lost+found", 10, NULL, &ino);
+  if (err != 0)
+    ext2_error_to_exception ("ext2fs_lookup", err, "/lost+found");
+  for (;;) {
+    err = ext2fs_read_inode (data.fs, ino, &inode);
+    if (err != 0)
+      ext2_error_to_exception ("ext2fs_read_inode", err, "/lost+found");
+    if (inode.i_size >= LOST_AND_FOUND_SIZE)
+      break;
+    err = ext2fs_expand_dir (data.fs, ino);
+    if (err != 0)
+      ext2_error_to_exception ("ext2fs_expand_dir", err, "/lost+found");
+  }
+
+  /* Reserve the inodes below the first usable inode, and create the
+   * (empty) bad blocks inode.
+   */
+  for (ino = EXT2_ROOT_INO + 1; ino < EXT2_FIRST_INODE (data.fs->super); ++ino)
+    ext2fs_inode_alloc_stats2 (data.fs, ino, +1, 0);
+  ext2fs_inode_alloc_stats2 (data.fs, EXT2_BAD_INO, +1, 0);
+  err = ext2fs_update_bb_inode (data.fs, NULL);
+  if (err != 0)
+    ext2_error_to_exception ("ext2fs_update_bb_inode", err, filename);
+
+  init_ext2_data (&data, debugv, dedupv);
 
   fsv = Val_ext2fs (&data);
   CAMLreturn (fsv);
 }
 
+value
+supermin_ext2fs_create_byte (value *argv, int argn)
+{
+  return supermin_ext2fs_create_native (argv[0], argv[1], argv[2],
+                                        argv[3], argv[4], argv[5],
+                                        argv[6]);
+}
+
 value
 supermin_ext2fs_close (value fsv)
 {
   CAMLparam1 (fsv);
+  struct ext2_data data = Ext2fs_val (fsv);
+
+  if (data.fs && data.debug >= 1) {
+    printf ("supermin: ext2: shared inodes: %" PRIu64 " inodes and "
+            "%" PRIu64 " bytes saved\n",
+            data.cache->inodes_saved, data.cache->bytes_saved);
+    fflush (stdout);
+  }
+
+  if (data.fs &&
+      (data.fs->super->s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX))
+    ext2_index_dirs (&data);
 
   ext2_finalize (fsv);
 
   /* So we don't double-free in the finalizer. */
   Ext2fs_val (fsv).fs = NULL;
+  Ext2fs_val (fsv).cache = NULL;
+
+  CAMLreturn (Val_unit);
+}
+
+/* Close the handle without writing anything back to the filesystem.
+ * This is used when an update fails part way through, so that the
+ * finalizer doesn't later flush stale metadata to the file.
+ */
+value
+supermin_ext2fs_discard (value fsv)
+{
+  CAMLparam1 (fsv);
+  struct ext2_data data = Ext2fs_val (fsv);
+
+  if (data.fs) {
+    ext2_cache_free (data.cache);
+    ext2fs_free (data.fs);
+  }
+
+  Ext2fs_val (fsv).fs = NULL;
+  Ext2fs_val (fsv).cache = NULL;
 
   CAMLreturn (Val_unit);
 }
@@ -191,12 +554,31 @@ supermin_ext2fs_read_bitmaps (value fsv)
   CAMLreturn (Val_unit);
 }
 
-static void ext2_mkdir (ext2_filsys fs, ext2_ino_t dir_ino, const char *dirname, const char *basename, mode_t mode, uid_t uid, gid_t gid, time_t ctime, time_t atime, time_t mtime);
-static void ext2_empty_inode (ext2_filsys fs, ext2_ino_t dir_ino, const char *dirname, const char *basename, mode_t mode, uid_t uid, gid_t gid, time_t ctime, time_t atime, time_t mtime, int major, int minor, int dir_ft, ext2_ino_t *ino_ret);
-static void ext2_write_host_file (ext2_filsys fs, ext2_ino_t ino, const char *src, const char *filename);
-static void ext2_link (ext2_filsys fs, ext2_ino_t dir_ino, const char *basename, ext2_ino_t ino, int dir_ft);
-static void ext2_clean_path (ext2_filsys fs, ext2_ino_t dir_ino, const char *dirname, const char *basename, int isdir);
+static ext2_ino_t ext2_mkdir (struct ext2_data *data, ext2_ino_t dir_ino, const char *dirname, const char *basename, mode_t mode, uid_t uid, gid_t gid, time_t ctime, time_t atime, time_t mtime, size_t presize);
+static void ext2_empty_inode (struct ext2_data *data, ext2_ino_t dir_ino, const char *dirname, const char *basename, mode_t mode, uid_t uid, gid_t gid, time_t ctime, time_t atime, time_t mtime, int major, int minor, int dir_ft, ext2_ino_t *ino_ret);
+static void ext2_write_host_file (ext2_filsys fs, ext2_ino_t ino, const char *src, const char *filename, const struct ext2_prefetched_file *pf, blk64_t goal);
+static void ext2_link (struct ext2_data *data, ext2_ino_t dir_ino, const char *basename, ext2_ino_t ino, int dir_ft);
+static void ext2_clean_path (struct ext2_data *data, ext2_ino_t dir_ino, const char *dirname, const char *basename, int isdir);
+static void ext2_rmdir (struct ext2_data *data, ext2_ino_t dir_ino, const char *basename, ext2_ino_t ino);
+static void ext2_remove_tree (struct ext2_data *data, ext2_ino_t dir_ino, const char *dirname, const char *basename, ext2_ino_t ino);
 static void ext2_copy_file (struct ext2_data *data, const char *src, const char *dest);
+static int ext2_link_inode (struct ext2_data *data, ext2_ino_t dir_ino, const char *basename, ext2_ino_t ino);
+static int ext2_hash_host_file (const char *src, const struct ext2_prefetched_file *pf, uint64_t *hash_ret);
+static ext2_ino_t ext2_cache_find_hard_link (struct ext2_data *data, const struct stat *statbuf);
+static void ext2_cache_add_hard_link (struct ext2_data *data, const struct stat *statbuf, ext2_ino_t ino);
+static ext2_ino_t ext2_cache_find_content (struct ext2_data *data, const struct stat *statbuf, const char *src, const struct ext2_prefetched_file *pf, uint64_t *hash_ret, int *hashed_ret);
+static void ext2_cache_add_content (struct ext2_data *data, const struct stat *statbuf, const char *src, int hashed, uint64_t hash, ext2_ino_t ino);
+static void ext2_cache_forget_inode (struct ext2_cache *cache, ext2_ino_t ino);
+static struct ext2_cached_dir *ext2_cache_dir (struct ext2_data *data, const char *path);
+static void ext2_cache_forget_dirs (struct ext2_cache *cache);
+static void ext2_prefetch_start (struct ext2_data *data, size_t nr_threads, char **srcs, size_t nr_srcs);
+static void ext2_prefetch_stop (struct ext2_cache *cache);
+static const struct ext2_prefetched_file *ext2_prefetch_get (struct ext2_data *data, const char *src);
+static struct ext2_dir *ext2_dir_new (struct ext2_data *data, ext2_ino_t ino, ext2_ino_t parent, blk64_t nr_blocks);
+static const struct ext2_name *ext2_dir_lookup (struct ext2_data *data, ext2_ino_t dir_ino, const char *basename);
+static void ext2_dir_remove (struct ext2_data *data, ext2_ino_t dir_ino, const char *basename);
+static void ext2_dir_extend (ext2_filsys fs, ext2_ino_t ino, struct ext2_inode *inode, ext2_ino_t parent, blk64_t n, const char *filename);
+static errcode_t ext2_namei (struct ext2_data *data, const char *path, ext2_ino_t *ino_ret);
 
 /* Copy the host filesystem file/directory 'src' to the destination
  * 'dest'.  Directories are NOT copied recursively - the directory is
@@ -292,6 +674,20 @@ supermin_ext2fs_copy_dir_recursively_from_host (value fsv,
       }
     }
 
+    /* Create directories with room for all of their entries.  fts
+     * reuses the list of children when it descends into the
+     * directory, so this doesn't read the directory twice.
+     */
+    if (entry->fts_info == FTS_D) {
+      FTSENT *child;
+      size_t presize = 0;
+
+      for (child = fts_children (fts, 0); child != NULL;
+           child = child->fts_link)
+        presize += EXT2_DIR_REC_LEN (child->fts_namelen);
+      ext2_cache_dir (&data, destpath)->presize += presize;
+    }
+
     ext2_copy_file (&data, entry->fts_path, destpath);
     free (destpath);
   }
@@ -302,6 +698,257 @@ supermin_ext2fs_copy_dir_recursively_from_host (value fsv,
   CAMLreturn (Val_unit);
 }
 
+/* The files 'pathsv' are going to be copied into the filesystem.
+ * Note the size of the directory entries needed in each parent
+ * directory, so that the directories can be created with enough
+ * blocks in one go.
+ */
+value
+supermin_ext2fs_presize_dirs (value fsv, value pathsv)
+{
+  CAMLparam2 (fsv, pathsv);
+  CAMLlocal1 (v);
+  struct ext2_data data;
+  const char *path, *p;
+  char *dirname;
+
+  data = Ext2fs_val (fsv);
+  if (data.fs == NULL)
+    ext2_handle_closed ();
+
+  for (v = pathsv; v != Val_int (0); v = Field (v, 1)) {
+    path = String_val (Field (v, 0));
+    p = strrchr (path, '/');
+    if (p == NULL || p == path) /* the root directory always exists */
+      continue;
+
+    dirname = strndup (path, p - path);
+    if (dirname == NULL)
+      caml_raise_out_of_memory ();
+    ext2_cache_dir (&data, dirname)->presize += EXT2_DIR_REC_LEN (strlen (p+1));
+    free (dirname);
+  }
+
+  CAMLreturn (Val_unit);
+}
+
+/* Blocks needed for a regular file of 'size' bytes. */
+static blk64_t
+layout_file_blocks (ext2_filsys fs, uint64_t size)
+{
+  blk64_t blocks = ROUND_UP (size, fs->blocksize);
+
+  /* A file with extents allocated in one range needs no more blocks.
+   * Otherwise allow for the indirect blocks past the 12 direct blocks
+   * in the inode.
+   */
+  if (!(fs->super->s_feature_incompat & EXT3_FEATURE_INCOMPAT_EXTENTS) &&
+      blocks > 12)
+    blocks += blocks / (fs->blocksize / sizeof (blk_t)) + 3;
+  return blocks;
+}
+
+static int
+compare_layout_file (const void *av, const void *bv)
+{
+  const struct ext2_layout_file *a = av, *b = bv;
+
+  return strcmp (a->path, b->path);
+}
+
+/* Reserve the first free blocks in the filesystem for the regular
+ * files 'filesv', a list of (path, size) in the order they should be
+ * laid out.  If there isn't enough space, the files at the end of the
+ * list are not reserved.
+ */
+value
+supermin_ext2fs_layout_files (value fsv, value filesv)
+{
+  CAMLparam2 (fsv, filesv);
+  CAMLlocal2 (v, filev);
+  struct ext2_data data;
+  struct ext2_layout_file *new;
+  blk64_t total = 0, nr_reserved, i, n, blk, last;
+  blk64_t *reserved;
+  size_t nr_files = 0;
+  errcode_t err;
+
+  data = Ext2fs_val (fsv);
+  if (data.fs == NULL)
+    ext2_handle_closed ();
+
+  ext2_layout_release (data.cache, data.fs);
+
+  for (v = filesv; v != Val_int (0); v = Field (v, 1))
+    total += layout_file_blocks (data.fs, Int64_val (Field (Field (v, 0), 1)));
+  if (total == 0)
+    CAMLreturn (Val_unit);
+
+  err = ext2fs_allocate_block_bitmap (data.fs, "layout",
+                                      &data.cache->layout_blocks);
+  if (err != 0)
+    ext2_error_to_exception ("ext2fs_allocate_block_bitmap", err, NULL);
+
+  /* Reserve the first 'total' free blocks.  These are contiguous
+   * except for the metadata at the start of each block group.
+   */
+  reserved = malloc (total * sizeof (blk64_t));
+  if (reserved == NULL)
+    caml_raise_out_of_memory ();
+  blk = data.fs->super->s_first_data_block;
+  last = ext2fs_blocks_count (data.fs->super) - 1;
+  for (nr_reserved = 0; nr_reserved < total && blk <= last; ++blk) {
+    err = ext2fs_find_first_zero_block_bitmap2 (data.fs->block_map,
+                                                blk, last, &blk);
+    if (err == ENOENT)
+      break;
+    if (err != 0)
+      ext2_error_to_exception ("ext2fs_find_first_zero_block_bitmap2",
+                               err, NULL);
+    ext2fs_mark_block_bitmap2 (data.fs->block_map, blk);
+    ext2fs_mark_block_bitmap2 (data.cache->layout_blocks, blk);
+    reserved[nr_reserved++] = blk;
+  }
+  if (nr_reserved > 0)
+    data.cache->layout_end = reserved[nr_reserved-1] + 1;
+
+  /* Give each file the next run of reserved blocks. */
+  for (i = 0, v = filesv; v != Val_int (0); v = Field (v, 1)) {
+    filev = Field (v, 0);
+    n = layout_file_blocks (data.fs, Int64_val (Field (filev, 1)));
+    if (n == 0)
+      continue;
+    if (i + n > nr_reserved)
+      break;
+
+    new = malloc (sizeof *new);
+    if (new == NULL)
+      caml_raise_out_of_memory ();
+    new->path = strdup (String_val (Field (filev, 0)));
+    if (new->path == NULL)
+      caml_raise_out_of_memory ();
+    new->start = reserved[i];
+    new->end = reserved[i+n-1] + 1;
+    if (tsearch (new, &data.cache->layout, compare_layout_file) == NULL)
+      caml_raise_out_of_memory ();
+    nr_files++;
+    i += n;
+  }
+  free (reserved);
+
+  if (data.debug >= 1) {
+    printf ("supermin: ext2: reserved %" PRIu64 " blocks for %zu files "
+            "in the layout trace\n",
+            (uint64_t) nr_reserved, nr_files);
+    fflush (stdout);
+  }
+
+  CAMLreturn (Val_unit);
+}
+
+/* Start 'jobsv' threads reading the list of host files 'srcsv'
+ * ahead.  The files must later be copied in the same order using
+ * supermin_ext2fs_copy_file_from_host.  Any other file can still be
+ * copied in between, it is simply read by the main thread.
+ */
+value
+supermin_ext2fs_prefetch_from_host (value fsv, value jobsv, value srcsv)
+{
+  CAMLparam3 (fsv, jobsv, srcsv);
+  CAMLlocal1 (v);
+  struct ext2_data data;
+  int jobs = Int_val (jobsv);
+  size_t i, n;
+  char **srcs;
+
+  data = Ext2fs_val (fsv);
+  if (data.fs == NULL)
+    ext2_handle_closed ();
+
+  ext2_prefetch_stop (data.cache);
+  if (jobs <= 0)
+    CAMLreturn (Val_unit);
+
+  /* The reader threads cannot access the OCaml heap, so take a copy
+   * of the list.
+   */
+  for (n = 0, v = srcsv; v != Val_int (0); v = Field (v, 1))
+    n++;
+  if (n == 0)
+    CAMLreturn (Val_unit);
+  srcs = malloc (n * sizeof (char *));
+  if (srcs == NULL)
+    caml_raise_out_of_memory ();
+  for (i = 0, v = srcsv; v != Val_int (0); i++, v = Field (v, 1)) {
+    srcs[i] = strdup (String_val (Field (v, 0)));
+    if (srcs[i] == NULL)
+      caml_raise_out_of_memory ();
+  }
+
+  if (data.debug >= 1) {
+    printf ("supermin: ext2: reading host files with %d threads\n", jobs);
+    fflush (stdout);
+  }
+
+  ext2_prefetch_start (&data, jobs, srcs, n);
+
+  CAMLreturn (Val_unit);
+}
+
+/* Stop the reader threads, discarding any files not yet copied. */
+value
+supermin_ext2fs_prefetch_stop (value fsv)
+{
+  CAMLparam1 (fsv);
+  struct ext2_data data;
+
+  data = Ext2fs_val (fsv);
+  if (data.fs == NULL)
+    ext2_handle_closed ();
+
+  ext2_prefetch_stop (data.cache);
+
+  CAMLreturn (Val_unit);
+}
+
+/* Remove 'path' from the filesystem, if it exists.  Directories are
+ * only removed if they are empty.
+ */
+value
+supermin_ext2fs_remove (value fsv, value pathv)
+{
+  CAMLparam2 (fsv, pathv);
+  const char *path = String_val (pathv);
+  const char *p = strrchr (path, '/');
+  const struct ext2_name *entry;
+  struct ext2_data data;
+  ext2_ino_t dir_ino;
+  char *dirname;
+  errcode_t err;
+
+  data = Ext2fs_val (fsv);
+  if (data.fs == NULL)
+    ext2_handle_closed ();
+
+  if (p == NULL || p[1] == '\0')
+    CAMLreturn (Val_unit);
+  dirname = p == path ? strdup ("/") : strndup (path, p - path);
+  if (dirname == NULL)
+    caml_raise_out_of_memory ();
+
+  err = ext2_namei (&data, dirname, &dir_ino);
+  if (err == 0) {
+    entry = ext2_dir_lookup (&data, dir_ino, p+1);
+    if (entry && entry->dir_ft == EXT2_FT_DIR)
+      ext2_rmdir (&data, dir_ino, p+1, entry->ino);
+    else if (entry)
+      ext2_clean_path (&data, dir_ino, dirname, p+1, 0);
+  }
+
+  free (dirname);
+  CAMLreturn (Val_unit);
+}
+
 /* Change the permissions of 'path' to 'mode'.
  */
 value
@@ -378,259 +1025,1934 @@ supermin_ext2fs_chown (value fsv, value pathv, value uidv, value gidv)
   CAMLreturn (Val_unit);
 }
 
-static void
-ext2_mkdir (ext2_filsys fs,
-            ext2_ino_t dir_ino, const char *dirname, const char *basename,
-            mode_t mode, uid_t uid, gid_t gid,
-            time_t ctime, time_t atime, time_t mtime)
+value
+supermin_ext2fs_utimes (value fsv, value pathv,
+                        value atimev, value mtimev, value ctimev)
 {
+  CAMLparam5 (fsv, pathv, atimev, mtimev, ctimev);
+  const char *path = String_val (pathv);
   errcode_t err;
+  struct ext2_data data;
 
-  mode = LINUX_S_IFDIR | (mode & 03777);
+  data = Ext2fs_val (fsv);
+  if (data.fs == NULL)
+    ext2_handle_closed ();
 
-  /* Does the directory exist?  This is legitimate: we just skip
-   * this case.
-   */
   ext2_ino_t ino;
-  err = ext2fs_namei (fs, EXT2_ROOT_INO, dir_ino, basename, &ino);
-  if (err == 0)
-    return; /* skip */
-
-  /* Otherwise, create it. */
-  err = ext2fs_new_inode (fs, dir_ino, mode, 0, &ino);
-  if (err != 0)
-    ext2_error_to_exception ("ext2fs_new_inode", err, basename);
-
- try_again:
-  err = ext2fs_mkdir (fs, dir_ino, ino, basename);
-  if (err != 0) {
-    /* See: http://bugs.debian.org/cgi-bin/bugreport.cgi?bug=217892 */
-    if (err == EXT2_ET_DIR_NO_SPACE) {
-      err = ext2fs_expand_dir (fs, dir_ino);
-      if (err)
-        ext2_error_to_exception ("ext2fs_expand_dir", err, dirname);
-      goto try_again;
-    } else
-      ext2_error_to_exception ("ext2fs_mkdir", err, basename);
+  ++path;
+  if (*path == 0) {             /* "/" */
+    ino = EXT2_ROOT_INO;
+  } else {                      /* "/foo" */
+    err = ext2fs_namei (data.fs, EXT2_ROOT_INO, EXT2_ROOT_INO, path, &ino);
+    if (err != 0)
+      ext2_error_to_exception ("ext2fs_namei", err, path);
   }
 
-  /* Copy the final permissions, UID etc. to the inode. */
   struct ext2_inode inode;
-  err = ext2fs_read_inode (fs, ino, &inode);
+  err = ext2fs_read_inode (data.fs, ino, &inode);
   if (err != 0)
-    ext2_error_to_exception ("ext2fs_read_inode", err, basename);
+    ext2_error_to_exception ("ext2fs_read_inode", err, path);
+  inode.i_atime = Double_val (atimev);
+  inode.i_mtime = Double_val (mtimev);
+  inode.i_ctime = Double_val (ctimev);
+  err = ext2fs_write_inode (data.fs, ino, &inode);
+  if (err != 0)
+    ext2_error_to_exception ("ext2fs_write_inode", err, path);
+
+  CAMLreturn (Val_unit);
+}
+
+/* On ext4, regular files and directories use extents.  Opening an
+ * extent handle on a new inode initializes the (empty) extent tree
+ * and sets the flag.
+ */
+static void
+ext2_init_extents (ext2_filsys fs, ext2_ino_t ino, struct ext2_inode *inode,
+                   const char *filename)
+{
+  ext2_extent_handle_t handle;
+  errcode_t err;
+
+  if (!(fs->super->s_feature_incompat & EXT3_FEATURE_INCOMPAT_EXTENTS))
+    return;
+
+  err = ext2fs_extent_open2 (fs, ino, inode, &handle);
+  if (err != 0)
+    ext2_error_to_exception ("ext2fs_extent_open2", err, filename);
+  ext2fs_extent_free (handle);
+}
+
+/* Returns the inode of the new directory, or 0 if it existed already.
+ * 'presize' is the size of the entries which will be added to the
+ * new directory, if known, so that its blocks are allocated together.
+ */
+static ext2_ino_t
+ext2_mkdir (struct ext2_data *data,
+            ext2_ino_t dir_ino, const char *dirname, const char *basename,
+            mode_t mode, uid_t uid, gid_t gid,
+            time_t ctime, time_t atime, time_t mtime, size_t presize)
+{
+  ext2_filsys fs = data->fs;
+  errcode_t err;
+  struct ext2_inode inode;
+  blk64_t nr_blocks;
+
+  mode = LINUX_S_IFDIR | (mode & 03777);
+
+  /* Does the directory exist?  This is legitimate: we just skip
+   * this case.
+   */
+  if (ext2_dir_lookup (data, dir_ino, basename) != NULL)
+    return 0; /* skip */
+
+  /* Otherwise, create it. */
+  ext2_ino_t ino;
+  err = ext2fs_new_inode (fs, dir_ino, mode, 0, &ino);
+  if (err != 0)
+    ext2_error_to_exception ("ext2fs_new_inode", err, basename);
+
+  memset (&inode, 0, sizeof inode);
   inode.i_mode = mode;
   inode.i_uid = uid;
   inode.i_gid = gid;
+  inode.i_links_count = 2;
   inode.i_ctime = ctime;
   inode.i_atime = atime;
   inode.i_mtime = mtime;
-  err = ext2fs_write_inode (fs, ino, &inode);
+  ext2_init_extents (fs, ino, &inode, basename);
+
+  err = ext2fs_write_new_inode (fs, ino, &inode);
   if (err != 0)
     ext2_error_to_exception ("ext2fs_write_inode", err, basename);
+  ext2fs_inode_alloc_stats2 (fs, ino, +1, 1);
+
+  /* Room for ".", "..", the expected entries, and the space wasted
+   * at the end of each block.
+   */
+  nr_blocks = ROUND_UP (EXT2_DIR_REC_LEN (1) + EXT2_DIR_REC_LEN (2) +
+                        presize + presize / 8,
+                        fs->blocksize);
+  ext2_dir_extend (fs, ino, &inode, dir_ino, nr_blocks, basename);
+  ext2_dir_new (data, ino, dir_ino, nr_blocks);
+
+  ext2_link (data, dir_ino, basename, ino, EXT2_FT_DIR);
+
+  /* ".." in the new directory is another link to the parent. */
+  err = ext2fs_read_inode (fs, dir_ino, &inode);
+  if (err != 0)
+    ext2_error_to_exception ("ext2fs_read_inode", err, dirname);
+  inode.i_links_count++;
+  err = ext2fs_write_inode (fs, dir_ino, &inode);
+  if (err != 0)
+    ext2_error_to_exception ("ext2fs_write_inode", err, dirname);
+
+  return ino;
+}
+
+static void
+ext2_empty_inode (struct ext2_data *data,
+                  ext2_ino_t dir_ino, const char *dirname, const char *basename,
+                  mode_t mode, uid_t uid, gid_t gid,
+                  time_t ctime, time_t atime, time_t mtime,
+                  int major, int minor, int dir_ft, ext2_ino_t *ino_ret)
+{
+  ext2_filsys fs = data->fs;
+  errcode_t err;
+  struct ext2_inode inode;
+  ext2_ino_t ino;
+
+  err = ext2fs_new_inode (fs, dir_ino, mode, 0, &ino);
+  if (err != 0)
+    ext2_error_to_exception ("ext2fs_new_inode", err, dirname);
+
+  memset (&inode, 0, sizeof inode);
+  inode.i_mode = mode;
+  inode.i_uid = uid;
+  inode.i_gid = gid;
+  inode.i_blocks = 0;
+  inode.i_links_count = 1;
+  inode.i_ctime = ctime;
+  inode.i_atime = atime;
+  inode.i_mtime = mtime;
+  inode.i_size = 0;
+  inode.i_block[0] = (minor & 0xff) | (major << 8) | ((minor & ~0xff) << 12);
+
+  if (dir_ft == EXT2_FT_REG_FILE)
+    ext2_init_extents (fs, ino, &inode, basename);
+
+  err = ext2fs_write_new_inode (fs, ino, &inode);
+  if (err != 0)
+    ext2_error_to_exception ("ext2fs_write_inode", err, dirname);
+
+  ext2_link (data, dir_ino, basename, ino, dir_ft);
+
+  ext2fs_inode_alloc_stats2 (fs, ino, 1, 0);
+
+  if (ino_ret)
+    *ino_ret = ino;
+}
+
+/* Where the contents of a host file are read from: either an open
+ * file descriptor, or a buffer that was filled by a reader thread
+ * (see ext2_prefetch below).
+ */
+struct host_file
+{
+  int fd;                       /* -1 if reading from buf */
+  const char *buf;
+  size_t size;
+};
+
+static ssize_t
+host_file_pread (const struct host_file *hf, void *buf, size_t n, off_t offset)
+{
+  if (hf->fd >= 0)
+    return pread (hf->fd, buf, n, offset);
+
+  if ((size_t) offset >= hf->size)
+    return 0;
+  if (n > hf->size - offset)
+    n = hf->size - offset;
+  memcpy (buf, hf->buf + offset, n);
+  return n;
+}
+
+#ifdef HAVE_EXT2FS_FALLOCATE
+
+/* Maximum number of bytes copied by a single write to the output. */
+#define COPY_BUFFER_SIZE (1024 * 1024)
+
+/* The current run of blocks which are contiguous both in the host
+ * file and in the filesystem.
+ */
+struct copy_run
+{
+  const struct host_file *hf;
+  char *buf;
+  blk64_t max_len;              /* size of buf in blocks */
+  blk64_t lblk;                 /* first logical block of the run */
+  blk64_t pblk;                 /* first physical block of the run */
+  blk64_t len;                  /* number of blocks in the run */
+  int read_errno;               /* errno if read from host failed */
+  errcode_t err;                /* error if write to filesystem failed */
+};
+
+static int
+flush_run (ext2_filsys fs, struct copy_run *run)
+{
+  size_t n = run->len * fs->blocksize;
+  off_t offset = run->lblk * fs->blocksize;
+  size_t done = 0;
+  ssize_t r;
+
+  if (run->len == 0)
+    return 0;
+
+  while (done < n) {
+    r = host_file_pread (run->hf, run->buf + done, n - done, offset + done);
+    if (r == -1) {
+      run->read_errno = errno;
+      return -1;
+    }
+    if (r == 0)                 /* file was truncated under us */
+      break;
+    done += r;
+  }
+  /* Zero the tail of the final block. */
+  memset (run->buf + done, 0, n - done);
+
+  run->err = io_channel_write_blk64 (fs->io, run->pblk, run->len, run->buf);
+  if (run->err != 0)
+    return -1;
+
+  run->len = 0;
+  return 0;
+}
+
+static int
+copy_block (ext2_filsys fs, blk64_t *blocknr, e2_blkcnt_t blockcnt,
+            blk64_t ref_blk, int ref_offset, void *private)
+{
+  struct copy_run *run = private;
+
+  if (run->len > 0 && run->len < run->max_len &&
+      (blk64_t) blockcnt == run->lblk + run->len &&
+      *blocknr == run->pblk + run->len) {
+    run->len++;
+    return 0;
+  }
+
+  if (flush_run (fs, run) == -1)
+    return BLOCK_ABORT;
+  run->lblk = blockcnt;
+  run->pblk = *blocknr;
+  run->len = 1;
+  return 0;
+}
+
+/* For block-mapped inodes, ext2fs_fallocate ignores the goal and
+ * allocates near the inode, so allocate the blocks of the file one
+ * at a time starting at the goal.  Any indirect blocks are allocated
+ * by ext2fs_bmap2 after the previous block.
+ */
+static void
+allocate_blocks_at_goal (ext2_filsys fs, ext2_ino_t ino,
+                         struct ext2_inode *inode, blk64_t goal,
+                         blk64_t blocks, const char *filename)
+{
+  errcode_t err;
+  blk64_t lblk, pblk;
+
+  for (lblk = 0; lblk < blocks; ++lblk) {
+    err = ext2fs_new_block2 (fs, goal, NULL, &pblk);
+    if (err != 0)
+      ext2_error_to_exception ("ext2fs_new_block2", err, filename);
+    ext2fs_block_alloc_stats2 (fs, pblk, +1);
+    err = ext2fs_bmap2 (fs, ino, inode, NULL, BMAP_ALLOC|BMAP_SET,
+                        lblk, NULL, &pblk);
+    if (err != 0)
+      ext2_error_to_exception ("ext2fs_bmap2", err, filename);
+    /* ext2fs_bmap2 only counts the indirect blocks it allocated. */
+    err = ext2fs_iblk_add_blocks (fs, inode, 1);
+    if (err != 0)
+      ext2_error_to_exception ("ext2fs_iblk_add_blocks", err, filename);
+    goal = pblk + 1;
+  }
+}
+
+/* Allocate all the blocks needed by the file up front (so they are
+ * as contiguous as possible), then copy the host file directly into
+ * those blocks in large writes, bypassing the block-at-a-time
+ * ext2fs_file_write interface.
+ */
+static void
+write_host_file_blocks (ext2_filsys fs, ext2_ino_t ino,
+                        const struct host_file *hf, const char *filename,
+                        blk64_t goal)
+{
+  errcode_t err;
+  struct ext2_inode inode;
+  struct copy_run run;
+  blk64_t blocks;
+
+  if (hf->size == 0)
+    return;
+  blocks = ROUND_UP (hf->size, fs->blocksize);
+
+  err = ext2fs_read_inode (fs, ino, &inode);
+  if (err != 0)
+    ext2_error_to_exception ("ext2fs_read_inode", err, filename);
+  err = ext2fs_inode_size_set (fs, &inode, hf->size);
+  if (err != 0)
+    ext2_error_to_exception ("ext2fs_inode_size_set", err, filename);
+
+  /* This updates 'inode' with the new block map and block count.
+   * The extents must be marked as initialized, since we write the
+   * data directly to the blocks, else the file reads as zeroes.
+   */
+  if (goal != ~0ULL && !(inode.i_flags & EXT4_EXTENTS_FL))
+    allocate_blocks_at_goal (fs, ino, &inode, goal, blocks, filename);
+  else {
+    err = ext2fs_fallocate (fs, EXT2_FALLOCATE_FORCE_INIT, ino, &inode,
+                            goal, 0, blocks);
+    if (err != 0)
+      ext2_error_to_exception ("ext2fs_fallocate", err, filename);
+  }
+
+  memset (&run, 0, sizeof run);
+  run.hf = hf;
+  run.max_len = COPY_BUFFER_SIZE / fs->blocksize;
+  if (run.max_len > blocks)
+    run.max_len = blocks;
+  run.buf = malloc (run.max_len * fs->blocksize);
+  if (run.buf == NULL)
+    caml_raise_out_of_memory ();
+
+  err = ext2fs_block_iterate3 (fs, ino,
+                               BLOCK_FLAG_READ_ONLY|BLOCK_FLAG_DATA_ONLY,
+                               NULL, copy_block, &run);
+  if (err == 0 && run.read_errno == 0 && run.err == 0)
+    flush_run (fs, &run);
+  free (run.buf);
+
+  if (run.read_errno != 0)
+    unix_error (run.read_errno, (char *) "read", caml_copy_string (filename));
+  if (run.err != 0)
+    ext2_error_to_exception ("io_channel_write_blk64", run.err, filename);
+  if (err != 0)
+    ext2_error_to_exception ("ext2fs_block_iterate3", err, filename);
+
+  err = ext2fs_write_inode (fs, ino, &inode);
+  if (err != 0)
+    ext2_error_to_exception ("ext2fs_write_inode", err, filename);
+}
+
+#else /* !HAVE_EXT2FS_FALLOCATE */
+
+/* Copy the file through the ext2fs_file_* interface, for old
+ * versions of libext2fs which do not have ext2fs_fallocate.
+ */
+static void
+write_host_file_stream (ext2_filsys fs, ext2_ino_t ino,
+                        const struct host_file *hf, const char *filename)
+{
+  char buf[BUFSIZ];
+  ssize_t r;
+  size_t size = 0;
+  errcode_t err;
+  ext2_file_t file;
+  unsigned int written;
+
+  err = ext2fs_file_open2 (fs, ino, NULL, EXT2_FILE_WRITE, &file);
+  if (err != 0)
+    ext2_error_to_exception ("ext2fs_file_open2", err, filename);
+
+  while ((r = host_file_pread (hf, buf, sizeof buf, size)) > 0) {
+    err = ext2fs_file_write (file, buf, r, &written);
+    if (err != 0)
+      ext2_error_to_exception ("ext2fs_file_open2", err, filename);
+    if ((ssize_t) written != r)
+      caml_failwith ("ext2fs_file_write: requested write size != bytes written");
+    size += written;
+  }
+
+  if (r == -1)
+    unix_error (errno, (char *) "read", caml_copy_string (filename));
+
+  /* Flush out the ext2 file. */
+  err = ext2fs_file_flush (file);
+  if (err != 0)
+    ext2_error_to_exception ("ext2fs_file_flush", err, filename);
+  err = ext2fs_file_close (file);
+  if (err != 0)
+    ext2_error_to_exception ("ext2fs_file_close", err, filename);
+
+  /* Update the true size in the inode. */
+  struct ext2_inode inode;
+  err = ext2fs_read_inode (fs, ino, &inode);
+  if (err != 0)
+    ext2_error_to_exception ("ext2fs_read_inode", err, filename);
+  inode.i_size = size;
+  err = ext2fs_write_inode (fs, ino, &inode);
+  if (err != 0)
+    ext2_error_to_exception ("ext2fs_write_inode", err, filename);
+}
+
+#endif /* !HAVE_EXT2FS_FALLOCATE */
+
+static void
+ext2_warn_unreadable (const char *filename, int errnum)
+{
+  static int warned = 0;
+
+  /* We skip unreadable files.  However if the error is -EACCES then
+   * modify the message so as not to frighten the horses.
+   */
+  fprintf (stderr, "supermin: warning: %s: %s (ignored)\n",
+           filename, strerror (errnum));
+  if (errnum == EACCES && !warned) {
+    fprintf (stderr,
+             "Some distro files are not public readable, so supermin cannot copy them\n"
+             "into the appliance.  This is a problem with your Linux distro.  Please ask\n"
+             "your distro to stop doing pointless security by obscurity.\n"
+             "You can ignore these warnings.  You *do not* need to use sudo.\n");
+    warned = 1;
+  }
+}
+
+/* Copies the file contents from the host.  You must create the file
+ * first with ext2_empty_inode, and the host file must be a regular
+ * file.  If the file was read ahead ('pf' != NULL) then the contents
+ * are taken from there.  'goal' is where the blocks should be
+ * allocated, or ~0ULL to let libext2fs choose (this is ignored with
+ * old versions of libext2fs).
+ */
+static void
+ext2_write_host_file (ext2_filsys fs,
+                      ext2_ino_t ino,
+                      const char *src, /* source (host) file */
+                      const char *filename,
+                      const struct ext2_prefetched_file *pf,
+                      blk64_t goal)
+{
+  struct host_file hf;
+  struct stat statbuf;
+
+  if (pf && pf->open_errno != 0) {
+    ext2_warn_unreadable (filename, pf->open_errno);
+    return;
+  }
+
+  if (pf && pf->content) {
+    hf.fd = -1;
+    hf.buf = pf->content;
+    hf.size = pf->size;
+  }
+  else {
+    hf.fd = open (src, O_RDONLY);
+    if (hf.fd == -1) {
+      ext2_warn_unreadable (filename, errno);
+      return;
+    }
+    if (fstat (hf.fd, &statbuf) == -1)
+      unix_error (errno, (char *) "fstat", caml_copy_string (filename));
+    hf.buf = NULL;
+    hf.size = statbuf.st_size;
+  }
+
+#ifdef HAVE_EXT2FS_FALLOCATE
+  write_host_file_blocks (fs, ino, &hf, filename, goal);
+#else
+  write_host_file_stream (fs, ino, &hf, filename);
+#endif
+
+  if (hf.fd >= 0 && close (hf.fd) == -1)
+    unix_error (errno, (char *) "close", caml_copy_string (filename));
+}
+
+static int
+compare_name (const void *av, const void *bv)
+{
+  const struct ext2_name *a = av, *b = bv;
+
+  return strcmp (a->name, b->name);
+}
+
+static int
+compare_fs_dir (const void *av, const void *bv)
+{
+  const struct ext2_dir *a = av, *b = bv;
+
+  if (a->ino != b->ino)
+    return a->ino < b->ino ? -1 : 1;
+  return 0;
+}
+
+static struct ext2_dir *
+ext2_dir_new (struct ext2_data *data,
+              ext2_ino_t ino, ext2_ino_t parent, blk64_t nr_blocks)
+{
+  struct ext2_dir *new;
+
+  new = calloc (1, sizeof *new);
+  if (new == NULL)
+    caml_raise_out_of_memory ();
+  new->ino = ino;
+  new->parent = parent;
+  new->nr_blocks = nr_blocks;
+
+  if (tsearch (new, &data->cache->fs_dirs, compare_fs_dir) == NULL)
+    caml_raise_out_of_memory ();
+  new->next = data->cache->fs_dir_list;
+  data->cache->fs_dir_list = new;
+  return new;
+}
+
+static void
+ext2_dir_insert (struct ext2_dir *dir, const char *name, size_t len,
+                 ext2_ino_t ino, int dir_ft)
+{
+  struct ext2_name *new, **entry;
+
+  new = malloc (sizeof *new);
+  if (new == NULL)
+    caml_raise_out_of_memory ();
+  new->name = strndup (name, len);
+  if (new->name == NULL)
+    caml_raise_out_of_memory ();
+  new->ino = ino;
+  new->dir_ft = dir_ft;
+
+  entry = tsearch (new, &dir->names, compare_name);
+  if (entry == NULL)
+    caml_raise_out_of_memory ();
+  if (*entry != new) {
+    /* Callers remove any old entry first, so this shouldn't happen. */
+    (*entry)->ino = ino;
+    (*entry)->dir_ft = dir_ft;
+    free (new->name);
+    free (new);
+  }
+  else
+    dir->nr_names++;
+}
+
+/* Old versions of libext2fs don't have ext2fs_dirent_name_len etc.
+ * The high byte of name_len is the file type.
+ */
+#define DIRENT_NAME_LEN(dirent) ((dirent)->name_len & 0xff)
+
+static int
+load_dir_entry (struct ext2_dir_entry *dirent,
+                int offset, int blocksize, char *buf, void *dirv)
+{
+  struct ext2_dir *dir = dirv;
+  int len = DIRENT_NAME_LEN (dirent);
+
+  if (len == 1 && dirent->name[0] == '.')
+    return 0;
+  if (len == 2 && dirent->name[0] == '.' && dirent->name[1] == '.') {
+    dir->parent = dirent->inode;
+    return 0;
+  }
+  ext2_dir_insert (dir, dirent->name, len, dirent->inode, dirent->name_len >> 8);
+  return 0;
+}
+
+/* Find the directory 'ino', reading its entries from the filesystem
+ * the first time.
+ */
+static struct ext2_dir *
+ext2_dir_get (struct ext2_data *data, ext2_ino_t ino)
+{
+  struct ext2_dir key, **entry, *dir;
+  struct ext2_inode inode;
+  errcode_t err;
+
+  key.ino = ino;
+  entry = tfind (&key, &data->cache->fs_dirs, compare_fs_dir);
+  if (entry)
+    return *entry;
+
+  err = ext2fs_read_inode (data->fs, ino, &inode);
+  if (err != 0)
+    ext2_error_to_exception ("ext2fs_read_inode", err, NULL);
+  if (!LINUX_S_ISDIR (inode.i_mode))
+    ext2_error_to_exception ("ext2fs_read_inode", EXT2_ET_NO_DIRECTORY, NULL);
+
+  /* We add entries without updating the hash index, so turn an
+   * indexed directory back into a linear one (which it is as well,
+   * for readers that don't understand the index).  It is indexed
+   * again when the filesystem is closed.
+   */
+  if (inode.i_flags & EXT2_INDEX_FL) {
+    inode.i_flags &= ~EXT2_INDEX_FL;
+    err = ext2fs_write_inode (data->fs, ino, &inode);
+    if (err != 0)
+      ext2_error_to_exception ("ext2fs_write_inode", err, NULL);
+  }
+
+  dir = ext2_dir_new (data, ino, 0, EXT2_I_SIZE (&inode) / data->fs->blocksize);
+  if (dir->nr_blocks > 0)
+    dir->cur_lblk = dir->nr_blocks - 1;
+  err = ext2fs_dir_iterate (data->fs, ino, 0, NULL, load_dir_entry, dir);
+  if (err != 0)
+    ext2_error_to_exception ("ext2fs_dir_iterate", err, NULL);
+
+  return dir;
+}
+
+static const struct ext2_name *
+ext2_dir_lookup (struct ext2_data *data,
+                 ext2_ino_t dir_ino, const char *basename)
+{
+  struct ext2_dir *dir = ext2_dir_get (data, dir_ino);
+  struct ext2_name key, **entry;
+
+  key.name = (char *) basename;
+  entry = tfind (&key, &dir->names, compare_name);
+  return entry ? *entry : NULL;
+}
+
+static void
+set_dirent (ext2_filsys fs, struct ext2_dir_entry *dirent,
+            const char *name, ext2_ino_t ino, int dir_ft, unsigned int rec_len)
+{
+  size_t name_len = strlen (name);
+
+  if (!(fs->super->s_feature_incompat & EXT2_FEATURE_INCOMPAT_FILETYPE))
+    dir_ft = 0;
+
+  dirent->inode = ino;
+  ext2fs_set_rec_len (fs, rec_len, dirent);
+  dirent->name_len = name_len | (dir_ft << 8);
+  memcpy (dirent->name, name, name_len);
+}
+
+/* Add an entry after the last entry in the directory block 'buf'.
+ * Returns false if there is not enough space.
+ */
+static int
+dir_block_add (ext2_filsys fs, char *buf,
+               const char *name, ext2_ino_t ino, int dir_ft)
+{
+  unsigned int offset = 0, rec_len, used;
+  unsigned int needed = EXT2_DIR_REC_LEN (strlen (name));
+  struct ext2_dir_entry *dirent;
+
+  for (;;) {
+    dirent = (struct ext2_dir_entry *) (buf + offset);
+    if (ext2fs_get_rec_len (fs, dirent, &rec_len) != 0 ||
+        rec_len < 8 || offset + rec_len > fs->blocksize)
+      return 0;                 /* corrupt, don't touch it */
+    if (offset + rec_len == fs->blocksize)
+      break;
+    offset += rec_len;
+  }
+
+  used = dirent->inode ? EXT2_DIR_REC_LEN (DIRENT_NAME_LEN (dirent)) : 0;
+  if (rec_len - used < needed)
+    return 0;
+
+  if (used > 0) {
+    ext2fs_set_rec_len (fs, used, dirent);
+    dirent = (struct ext2_dir_entry *) (buf + offset + used);
+  }
+  set_dirent (fs, dirent, name, ino, dir_ft, rec_len - used);
+  return 1;
+}
+
+/* Append 'n' empty blocks to the directory 'ino'.  If 'parent' is not
+ * 0, this is a new directory and the first block has the "." and ".."
+ * entries.
+ */
+static void
+ext2_dir_extend (ext2_filsys fs, ext2_ino_t ino, struct ext2_inode *inode,
+                 ext2_ino_t parent, blk64_t n, const char *filename)
+{
+  blk64_t lblk = EXT2_I_SIZE (inode) / fs->blocksize;
+  blk64_t i, pblk;
+  char *buf;
+  errcode_t err;
+
+  for (i = 0; i < n; ++i, ++lblk) {
+    pblk = 0;
+    err = ext2fs_bmap2 (fs, ino, inode, NULL, BMAP_ALLOC, lblk, NULL, &pblk);
+    if (err != 0)
+      ext2_error_to_exception ("ext2fs_bmap2", err, filename);
+
+    if (parent != 0 && lblk == 0)
+      err = ext2fs_new_dir_block (fs, ino, parent, &buf);
+    else
+      err = ext2fs_new_dir_block (fs, 0, 0, &buf);
+    if (err != 0)
+      ext2_error_to_exception ("ext2fs_new_dir_block", err, filename);
+    err = ext2fs_write_dir_block3 (fs, pblk, buf, 0);
+    ext2fs_free_mem (&buf);
+    if (err != 0)
+      ext2_error_to_exception ("ext2fs_write_dir_block3", err, filename);
+  }
+
+  inode->i_size = lblk * fs->blocksize;
+  err = ext2fs_write_inode (fs, ino, inode);
+  if (err != 0)
+    ext2_error_to_exception ("ext2fs_write_inode", err, filename);
+}
+
+/* Add the entry 'basename' to the directory 'dir_ino'.  This replaces
+ * ext2fs_link, which scans the whole directory for free space, and
+ * when the directory is full ext2fs_expand_dir, which adds one block
+ * at a time and also scans the whole directory.
+ */
+static void
+ext2_link (struct ext2_data *data,
+           ext2_ino_t dir_ino, const char *basename, ext2_ino_t ino, int dir_ft)
+{
+  ext2_filsys fs = data->fs;
+  struct ext2_dir *dir = ext2_dir_get (data, dir_ino);
+  struct ext2_inode inode;
+  blk64_t pblk;
+  char *buf;
+  errcode_t err;
+
+  err = ext2fs_get_mem (fs->blocksize, &buf);
+  if (err != 0)
+    ext2_error_to_exception ("ext2fs_get_mem", err, basename);
+
+  for (;;) {
+    if (dir->cur_lblk >= dir->nr_blocks) {
+      err = ext2fs_read_inode (fs, dir_ino, &inode);
+      if (err != 0)
+        ext2_error_to_exception ("ext2fs_read_inode", err, basename);
+      ext2_dir_extend (fs, dir_ino, &inode, 0, 1, basename);
+      dir->nr_blocks++;
+    }
+
+    err = ext2fs_bmap2 (fs, dir_ino, NULL, NULL, 0, dir->cur_lblk, NULL, &pblk);
+    if (err != 0)
+      ext2_error_to_exception ("ext2fs_bmap2", err, basename);
+    err = ext2fs_read_dir_block3 (fs, pblk, buf, 0);
+    if (err != 0)
+      ext2_error_to_exception ("ext2fs_read_dir_block3", err, basename);
+    if (dir_block_add (fs, buf, basename, ino, dir_ft))
+      break;
+    dir->cur_lblk++;
+  }
+
+  err = ext2fs_write_dir_block3 (fs, pblk, buf, 0);
+  if (err != 0)
+    ext2_error_to_exception ("ext2fs_write_dir_block3", err, basename);
+  ext2fs_free_mem (&buf);
+
+  ext2_dir_insert (dir, basename, strlen (basename), ino, dir_ft);
+}
+
+static void
+ext2_dir_remove (struct ext2_data *data,
+                 ext2_ino_t dir_ino, const char *basename)
+{
+  struct ext2_dir *dir = ext2_dir_get (data, dir_ino);
+  struct ext2_name key, **entry, *name;
+  errcode_t err;
+
+  err = ext2fs_unlink (data->fs, dir_ino, basename, 0, 0);
+  if (err != 0)
+    ext2_error_to_exception ("ext2fs_unlink_inode", err, basename);
+
+  key.name = (char *) basename;
+  entry = tfind (&key, &dir->names, compare_name);
+  if (entry) {
+    name = *entry;
+    tdelete (&key, &dir->names, compare_name);
+    free (name->name);
+    free (name);
+    dir->nr_names--;
+  }
+}
+
+/* Look up the absolute 'path' using the directories in memory.  Paths
+ * through symlinks (or anything we don't find) are left to
+ * ext2fs_namei.
+ */
+static errcode_t
+ext2_namei (struct ext2_data *data, const char *path, ext2_ino_t *ino_ret)
+{
+  ext2_ino_t ino = EXT2_ROOT_INO;
+  const struct ext2_name *entry;
+  const char *p = path;
+  size_t len;
+  char *name;
+
+  for (;;) {
+    p += strspn (p, "/");
+    if (*p == '\0')
+      break;
+    len = strcspn (p, "/");
+    name = strndup (p, len);
+    if (name == NULL)
+      caml_raise_out_of_memory ();
+    entry = ext2_dir_lookup (data, ino, name);
+    free (name);
+    if (entry == NULL || entry->dir_ft != EXT2_FT_DIR)
+      return ext2fs_namei (data->fs, EXT2_ROOT_INO, EXT2_ROOT_INO, path,
+                           ino_ret);
+    ino = entry->ino;
+    p += len;
+  }
+
+  *ino_ret = ino;
+  return 0;
+}
+
+/* An entry of a directory that is being indexed. */
+struct ext2_hashed_name
+{
+  ext2_dirhash_t hash;
+  ext2_dirhash_t minor_hash;
+  const struct ext2_name *name;
+};
+
+/* twalk(3) has no user data parameter. */
+static struct ext2_hashed_name *hashed_names;
+static size_t nr_hashed_names;
+
+static void
+collect_name_action (const void *nodep, VISIT which, int depth)
+{
+  if (which == postorder || which == leaf)
+    hashed_names[nr_hashed_names++].name = *(const struct ext2_name **) nodep;
+}
+
+static int
+compare_hashed_name (const void *av, const void *bv)
+{
+  const struct ext2_hashed_name *a = av, *b = bv;
+
+  if (a->hash != b->hash)
+    return a->hash < b->hash ? -1 : 1;
+  if (a->minor_hash != b->minor_hash)
+    return a->minor_hash < b->minor_hash ? -1 : 1;
+  return 0;
+}
+
+/* Rewrite the directory as a hashed (htree) directory with a single
+ * level index: the first block holds "." and ".." and the index, and
+ * the entries are stored in the following blocks sorted by hash.
+ * This is the layout that e2fsck -D produces.  Returns true if the
+ * directory was indexed.
+ */
+static int
+ext2_index_dir (struct ext2_data *data, struct ext2_dir *dir)
+{
+  ext2_filsys fs = data->fs;
+  unsigned int blocksize = fs->blocksize;
+  unsigned int limit = (blocksize - 32) / sizeof (struct ext2_dx_entry);
+  int hash_alg = fs->super->s_def_hash_version;
+  struct ext2_dx_root_info *root_info;
+  struct ext2_dx_countlimit *countlimit;
+  struct ext2_dx_entry *dx_entries;
+  struct ext2_inode inode;
+  size_t i, j, nr_leaves, *leaf_start;
+  unsigned int offset, rec_len;
+  blk64_t pblk;
+  char *buf;
+  errcode_t err;
+
+  if (dir->nr_blocks < 2 || dir->nr_names == 0)
+    return 0;
+
+  if (fs->super->s_flags & EXT2_FLAGS_UNSIGNED_HASH)
+    hash_alg += 3;
+
+  /* Sort the entries by hash. */
+  hashed_names = malloc (dir->nr_names * sizeof (struct ext2_hashed_name));
+  if (hashed_names == NULL)
+    caml_raise_out_of_memory ();
+  nr_hashed_names = 0;
+  twalk (dir->names, collect_name_action);
+  assert (nr_hashed_names == dir->nr_names);
+  for (i = 0; i < nr_hashed_names; ++i) {
+    const char *name = hashed_names[i].name->name;
+
+    err = ext2fs_dirhash (hash_alg, name, strlen (name),
+                          fs->super->s_hash_seed,
+                          &hashed_names[i].hash, &hashed_names[i].minor_hash);
+    if (err != 0)
+      ext2_error_to_exception ("ext2fs_dirhash", err, name);
+  }
+  qsort (hashed_names, nr_hashed_names, sizeof (struct ext2_hashed_name),
+         compare_hashed_name);
+
+  /* Fill the leaf blocks in order.  Leaf j holds the entries from
+   * leaf_start[j] up to leaf_start[j+1].
+   */
+  leaf_start = malloc ((nr_hashed_names + 1) * sizeof (size_t));
+  if (leaf_start == NULL)
+    caml_raise_out_of_memory ();
+  nr_leaves = 0;
+  offset = blocksize;
+  for (i = 0; i < nr_hashed_names; ++i) {
+    rec_len = EXT2_DIR_REC_LEN (strlen (hashed_names[i].name->name));
+    if (offset + rec_len > blocksize) {
+      leaf_start[nr_leaves++] = i;
+      offset = 0;
+    }
+    offset += rec_len;
+  }
+  leaf_start[nr_leaves] = nr_hashed_names;
+
+  /* A single level index covers about 500 leaf blocks with 4K blocks.
+   * Larger directories are left linear.
+   */
+  if (nr_leaves > limit) {
+    free (leaf_start);
+    free (hashed_names);
+    return 0;
+  }
+
+  /* Make the directory exactly nr_leaves + 1 blocks long. */
+  err = ext2fs_read_inode (fs, dir->ino, &inode);
+  if (err != 0)
+    ext2_error_to_exception ("ext2fs_read_inode", err, NULL);
+  if (dir->nr_blocks < nr_leaves + 1)
+    ext2_dir_extend (fs, dir->ino, &inode, 0,
+                     nr_leaves + 1 - dir->nr_blocks, NULL);
+  else if (dir->nr_blocks > nr_leaves + 1) {
+    err = ext2fs_punch (fs, dir->ino, &inode, NULL,
+                        nr_leaves + 1, ~(blk64_t) 0);
+    if (err != 0)
+      ext2_error_to_exception ("ext2fs_punch", err, NULL);
+  }
+  dir->nr_blocks = dir->cur_lblk = nr_leaves + 1;
+
+  err = ext2fs_get_mem (blocksize, &buf);
+  if (err != 0)
+    ext2_error_to_exception ("ext2fs_get_mem", err, NULL);
+
+  /* The leaf blocks.  The last entry in each block takes up the rest
+   * of the block.
+   */
+  for (j = 0; j < nr_leaves; ++j) {
+    memset (buf, 0, blocksize);
+    offset = 0;
+    for (i = leaf_start[j]; i < leaf_start[j+1]; ++i) {
+      const struct ext2_name *name = hashed_names[i].name;
+
+      rec_len = EXT2_DIR_REC_LEN (strlen (name->name));
+      if (i == leaf_start[j+1] - 1)
+        rec_len = blocksize - offset;
+      set_dirent (fs, (struct ext2_dir_entry *) (buf + offset),
+                  name->name, name->ino, name->dir_ft, rec_len);
+      offset += rec_len;
+    }
+
+    err = ext2fs_bmap2 (fs, dir->ino, &inode, NULL, 0, j + 1, NULL, &pblk);
+    if (err != 0)
+      ext2_error_to_exception ("ext2fs_bmap2", err, NULL);
+    err = ext2fs_write_dir_block3 (fs, pblk, buf, 0);
+    if (err != 0)
+      ext2_error_to_exception ("ext2fs_write_dir_block3", err, NULL);
+  }
+
+  /* The root block.  ".." covers the rest of the block, so the index
+   * is invisible to readers which treat this as a linear directory.
+   */
+  memset (buf, 0, blocksize);
+  set_dirent (fs, (struct ext2_dir_entry *) buf,
+              ".", dir->ino, EXT2_FT_DIR, EXT2_DIR_REC_LEN (1));
+  set_dirent (fs, (struct ext2_dir_entry *) (buf + EXT2_DIR_REC_LEN (1)),
+              "..", dir->parent, EXT2_FT_DIR,
+              blocksize - EXT2_DIR_REC_LEN (1));
+  root_info = (struct ext2_dx_root_info *) (buf + 24);
+  root_info->hash_version = fs->super->s_def_hash_version;
+  root_info->info_length = sizeof *root_info;
+  /* The count and limit overlay the hash of the first index entry,
+   * which is implicitly 0.
+   */
+  countlimit = (struct ext2_dx_countlimit *) (buf + 32);
+  countlimit->limit = ext2fs_cpu_to_le16 (limit);
+  countlimit->count = ext2fs_cpu_to_le16 (nr_leaves);
+  dx_entries = (struct ext2_dx_entry *) (buf + 32);
+  dx_entries[0].block = ext2fs_cpu_to_le32 (1);
+  for (j = 1; j < nr_leaves; ++j) {
+    ext2_dirhash_t hash = hashed_names[leaf_start[j]].hash;
+
+    /* The low bit marks a leaf which continues entries with the same
+     * hash from the previous leaf.
+     */
+    if (hashed_names[leaf_start[j] - 1].hash == hash)
+      hash |= 1;
+    dx_entries[j].hash = ext2fs_cpu_to_le32 (hash);
+    dx_entries[j].block = ext2fs_cpu_to_le32 (j + 1);
+  }
+
+  err = ext2fs_bmap2 (fs, dir->ino, &inode, NULL, 0, 0, NULL, &pblk);
+  if (err != 0)
+    ext2_error_to_exception ("ext2fs_bmap2", err, NULL);
+  err = ext2fs_write_dir_block3 (fs, pblk, buf, 0);
+  if (err != 0)
+    ext2_error_to_exception ("ext2fs_write_dir_block3", err, NULL);
+
+  inode.i_flags |= EXT2_INDEX_FL;
+  inode.i_size = (nr_leaves + 1) * blocksize;
+  err = ext2fs_write_inode (fs, dir->ino, &inode);
+  if (err != 0)
+    ext2_error_to_exception ("ext2fs_write_inode", err, NULL);
+
+  ext2fs_free_mem (&buf);
+  free (leaf_start);
+  free (hashed_names);
+  return 1;
+}
+
+/* Index all the directories larger than one block. */
+static void
+ext2_index_dirs (struct ext2_data *data)
+{
+  struct ext2_dir *dir;
+  size_t n = 0;
+
+  for (dir = data->cache->fs_dir_list; dir != NULL; dir = dir->next)
+    n += ext2_index_dir (data, dir);
+
+  if (data->debug >= 1) {
+    printf ("supermin: ext2: indexed %zu directories\n", n);
+    fflush (stdout);
+  }
+}
+
+static int
+release_block (ext2_filsys fs, blk_t *blocknr,
+                int blockcnt, void *private)
+{
+  blk_t block;
+
+  block = *blocknr;
+  ext2fs_block_alloc_stats (fs, block, -1);
+  return 0;
+}
+
+/* unlink or rmdir path, if it exists. */
+static void
+ext2_clean_path (struct ext2_data *data, ext2_ino_t dir_ino,
+                 const char *dirname, const char *basename,
+                 int isdir)
+{
+  ext2_filsys fs = data->fs;
+  errcode_t err;
+
+  const struct ext2_name *entry = ext2_dir_lookup (data, dir_ino, basename);
+  if (entry == NULL)
+    return;
+  ext2_ino_t ino = entry->ino;
+
+  struct ext2_inode inode;
+  err = ext2fs_read_inode (fs, ino, &inode);
+  if (err != 0)
+    ext2_error_to_exception ("ext2fs_read_inode", err, basename);
+
+  /* An existing directory is kept if it is replaced by a directory,
+   * else it is removed along with everything in it.
+   */
+  if (LINUX_S_ISDIR (inode.i_mode)) {
+    if (!isdir)
+      ext2_remove_tree (data, dir_ino, dirname, basename, ino);
+    return;
+  }
+
+  if (!isdir) {
+    inode.i_links_count--;
+    err = ext2fs_write_inode (fs, ino, &inode);
+    if (err != 0)
+      ext2_error_to_exception ("ext2fs_write_inode", err, basename);
+
+    ext2_dir_remove (data, dir_ino, basename);
+
+    /* Directory lookups may have gone through this symlink. */
+    if (LINUX_S_ISLNK (inode.i_mode))
+      ext2_cache_forget_dirs (data->cache);
+
+    if (inode.i_links_count == 0) {
+      inode.i_dtime = time (NULL);
+      err = ext2fs_write_inode (fs, ino, &inode);
+      if (err != 0)
+        ext2_error_to_exception ("ext2fs_write_inode", err, basename);
+
+      if (ext2fs_inode_has_valid_blocks (&inode)) {
+	int flags = 0;
+	/* From the docs: "BLOCK_FLAG_READ_ONLY is a promise by the
+	 * caller that it will not modify returned block number."
+	 * RHEL 5 does not have this flag, so just omit it if it is
+	 * not defined.
+	 */
+#ifdef BLOCK_FLAG_READ_ONLY
+	flags |= BLOCK_FLAG_READ_ONLY;
+#endif
+        ext2fs_block_iterate (fs, ino, flags, NULL,
+                              release_block, NULL);
+      }
+
+      ext2fs_inode_alloc_stats2 (fs, ino, -1, isdir);
+
+      /* The inode may be reused, so don't share it any longer. */
+      ext2_cache_forget_inode (data->cache, ino);
+    }
+  }
+}
+
+/* Remove the directory 'basename' (inode 'ino') if it is empty. */
+static void
+ext2_rmdir (struct ext2_data *data, ext2_ino_t dir_ino,
+            const char *basename, ext2_ino_t ino)
+{
+  ext2_filsys fs = data->fs;
+  struct ext2_dir *dir = ext2_dir_get (data, ino), **dirp;
+  struct ext2_inode inode;
+  errcode_t err;
+  int flags = 0;
+
+  if (dir->nr_names > 0)
+    return;
+
+  ext2_dir_remove (data, dir_ino, basename);
+
+  err = ext2fs_read_inode (fs, ino, &inode);
+  if (err != 0)
+    ext2_error_to_exception ("ext2fs_read_inode", err, basename);
+  inode.i_links_count = 0;
+  inode.i_dtime = time (NULL);
+  err = ext2fs_write_inode (fs, ino, &inode);
+  if (err != 0)
+    ext2_error_to_exception ("ext2fs_write_inode", err, basename);
+#ifdef BLOCK_FLAG_READ_ONLY
+  flags |= BLOCK_FLAG_READ_ONLY;
+#endif
+  ext2fs_block_iterate (fs, ino, flags, NULL, release_block, NULL);
+  ext2fs_inode_alloc_stats2 (fs, ino, -1, 1);
+
+  /* The parent loses the link from "..". */
+  err = ext2fs_read_inode (fs, dir_ino, &inode);
+  if (err != 0)
+    ext2_error_to_exception ("ext2fs_read_inode", err, basename);
+  if (inode.i_links_count > 2)
+    inode.i_links_count--;
+  err = ext2fs_write_inode (fs, dir_ino, &inode);
+  if (err != 0)
+    ext2_error_to_exception ("ext2fs_write_inode", err, basename);
+
+  /* Forget the directory, and any lookups which went through it. */
+  tdelete (dir, &data->cache->fs_dirs, compare_fs_dir);
+  for (dirp = &data->cache->fs_dir_list; *dirp != dir; dirp = &(*dirp)->next)
+    ;
+  *dirp = dir->next;
+  free (dir);
+  ext2_cache_forget_dirs (data->cache);
+}
+
+/* twalk(3) has no user data parameter. */
+static struct ext2_name *removed_names;
+static size_t nr_removed_names;
+
+static void
+collect_removed_name_action (const void *nodep, VISIT which, int depth)
+{
+  if (which == postorder || which == leaf)
+    removed_names[nr_removed_names++] = **(struct ext2_name **) nodep;
+}
+
+/* Remove the directory 'basename' (inode 'ino') and everything in
+ * it.  ext2_rmdir forgets the cached lookups which went through it.
+ */
+static void
+ext2_remove_tree (struct ext2_data *data, ext2_ino_t dir_ino,
+                  const char *dirname, const char *basename, ext2_ino_t ino)
+{
+  struct ext2_dir *dir = ext2_dir_get (data, ino);
+  struct ext2_name *names = NULL;
+  size_t i, nr_names = dir->nr_names;
+  char *path;
+
+  /* Copy the names first, since removing them changes the tree. */
+  if (nr_names > 0) {
+    names = malloc (nr_names * sizeof (struct ext2_name));
+    if (names == NULL)
+      caml_raise_out_of_memory ();
+    removed_names = names;
+    nr_removed_names = 0;
+    twalk (dir->names, collect_removed_name_action);
+    assert (nr_removed_names == nr_names);
+    for (i = 0; i < nr_names; ++i) {
+      names[i].name = strdup (names[i].name);
+      if (names[i].name == NULL)
+        caml_raise_out_of_memory ();
+    }
+  }
+
+  if (asprintf (&path, "%s/%s",
+                strcmp (dirname, "/") == 0 ? "" : dirname, basename) == -1)
+    caml_raise_out_of_memory ();
+
+  for (i = 0; i < nr_names; ++i) {
+    ext2_clean_path (data, ino, path, names[i].name, 0);
+    free (names[i].name);
+  }
+  free (names);
+  free (path);
+
+  ext2_rmdir (data, dir_ino, basename, ino);
+}
+
+/* Add another directory entry pointing to an existing regular file
+ * inode, and increment its link count.  Returns true if this was
+ * done, or false if the inode cannot be linked again (eg. because
+ * it has reached the maximum link count), in which case the caller
+ * should copy the file instead.
+ */
+static int
+ext2_link_inode (struct ext2_data *data,
+                 ext2_ino_t dir_ino, const char *basename, ext2_ino_t ino)
+{
+  ext2_filsys fs = data->fs;
+  errcode_t err;
+  struct ext2_inode inode;
+
+  err = ext2fs_read_inode (fs, ino, &inode);
+  if (err != 0)
+    ext2_error_to_exception ("ext2fs_read_inode", err, basename);
+  if (inode.i_links_count == 0 || inode.i_links_count >= EXT2_LINK_MAX)
+    return 0;
+
+  ext2_link (data, dir_ino, basename, ino, EXT2_FT_REG_FILE);
+
+  inode.i_links_count++;
+  err = ext2fs_write_inode (fs, ino, &inode);
+  if (err != 0)
+    ext2_error_to_exception ("ext2fs_write_inode", err, basename);
+
+  return 1;
+}
+
+static uint64_t
+hash_bytes (uint64_t hash, const unsigned char *buf, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < n; ++i) {
+    hash ^= buf[i];
+    hash *= UINT64_C(0x100000001b3);
+  }
+  return hash;
+}
+
+/* Hash the content of a host file (64 bit FNV-1a).  This is only
+ * used to find candidate duplicates, which are then compared
+ * byte-for-byte.  Returns -1 if the file could not be read, in which
+ * case the caller just copies it normally.
+ */
+static int
+ext2_hash_host_file (const char *src, const struct ext2_prefetched_file *pf,
+                     uint64_t *hash_ret)
+{
+  int fd;
+  unsigned char buf[BUFSIZ];
+  ssize_t r;
+  uint64_t hash = UINT64_C(0xcbf29ce484222325);
+
+  if (pf && pf->content) {
+    *hash_ret = hash_bytes (hash, (const unsigned char *) pf->content,
+                            pf->size);
+    return 0;
+  }
+
+  fd = open (src, O_RDONLY);
+  if (fd == -1)
+    return -1;
+
+  while ((r = read (fd, buf, sizeof buf)) > 0)
+    hash = hash_bytes (hash, buf, r);
+  close (fd);
+  if (r == -1)
+    return -1;
+
+  *hash_ret = hash;
+  return 0;
+}
+
+/* Read exactly 'n' bytes, unless we hit the end of the file. */
+static ssize_t
+full_read (int fd, void *buf, size_t n)
+{
+  size_t offset = 0;
+  ssize_t r;
+
+  while (offset < n) {
+    r = read (fd, (char *) buf + offset, n - offset);
+    if (r == -1)
+      return -1;
+    if (r == 0)
+      break;
+    offset += r;
+  }
+  return offset;
+}
+
+/* Returns true iff the two host files have identical content. */
+static int
+same_content (const char *src1, const char *src2)
+{
+  int fd1, fd2;
+  char buf1[BUFSIZ], buf2[BUFSIZ];
+  ssize_t r1, r2;
+  int ret = 0;
+
+  fd1 = open (src1, O_RDONLY);
+  if (fd1 == -1)
+    return 0;
+  fd2 = open (src2, O_RDONLY);
+  if (fd2 == -1) {
+    close (fd1);
+    return 0;
+  }
+
+  for (;;) {
+    r1 = full_read (fd1, buf1, sizeof buf1);
+    r2 = full_read (fd2, buf2, sizeof buf2);
+    if (r1 == -1 || r2 == -1 || r1 != r2 || memcmp (buf1, buf2, r1) != 0)
+      break;
+    if (r1 == 0) {
+      ret = 1;
+      break;
+    }
+  }
+
+  close (fd1);
+  close (fd2);
+  return ret;
+}
+
+static int
+compare_hard_link (const void *av, const void *bv)
+{
+  const struct ext2_copied_file *a = av, *b = bv;
+
+  if (a->dev != b->dev)
+    return a->dev < b->dev ? -1 : 1;
+  if (a->host_ino != b->host_ino)
+    return a->host_ino < b->host_ino ? -1 : 1;
+  return 0;
+}
+
+static int
+compare_size (const void *av, const void *bv)
+{
+  const struct ext2_copied_file *a = av, *b = bv;
+
+  if (a->size != b->size)
+    return a->size < b->size ? -1 : 1;
+  if (a->mode != b->mode)
+    return a->mode < b->mode ? -1 : 1;
+  if (a->uid != b->uid)
+    return a->uid < b->uid ? -1 : 1;
+  if (a->gid != b->gid)
+    return a->gid < b->gid ? -1 : 1;
+  return 0;
+}
+
+static int
+compare_content (const void *av, const void *bv)
+{
+  const struct ext2_copied_file *a = av, *b = bv;
+
+  if (a->size != b->size)
+    return a->size < b->size ? -1 : 1;
+  if (a->hash != b->hash)
+    return a->hash < b->hash ? -1 : 1;
+  if (a->mode != b->mode)
+    return a->mode < b->mode ? -1 : 1;
+  if (a->uid != b->uid)
+    return a->uid < b->uid ? -1 : 1;
+  if (a->gid != b->gid)
+    return a->gid < b->gid ? -1 : 1;
+  return 0;
+}
+
+static ext2_ino_t
+ext2_cache_find_hard_link (struct ext2_data *data, const struct stat *statbuf)
+{
+  struct ext2_copied_file key, **entry;
+
+  if (statbuf->st_nlink <= 1)
+    return 0;
+
+  key.dev = statbuf->st_dev;
+  key.host_ino = statbuf->st_ino;
+  entry = tfind (&key, &data->cache->hard_links, compare_hard_link);
+  return entry ? (*entry)->ino : 0;
+}
+
+/* Insert 'new' into the tree, replacing any previous entry with the
+ * same key (which must refer to a freed or unshareable inode, else
+ * we would have found it).
+ */
+static void
+cache_insert (void **root, struct ext2_copied_file *new,
+              int (*compare) (const void *, const void *))
+{
+  struct ext2_copied_file **entry;
+
+  entry = tsearch (new, root, compare);
+  if (entry == NULL)
+    caml_raise_out_of_memory ();
+  if (*entry != new) {
+    free ((*entry)->src);
+    free (*entry);
+    *entry = new;
+  }
+}
+
+/* Find an earlier file with the same content, mode and ownership.
+ * Files are only hashed once a second file with the same size, mode
+ * and ownership is copied, at which point the first one is hashed
+ * too, so unique files are not read twice.  '*hashed_ret' is set to
+ * 1 if the file was hashed (into '*hash_ret'), 0 if it is the first
+ * file of its size, or -1 if it could not be hashed.  This is passed
+ * to ext2_cache_add_content.
+ */
+static ext2_ino_t
+ext2_cache_find_content (struct ext2_data *data, const struct stat *statbuf,
+                         const char *src, const struct ext2_prefetched_file *pf,
+                         uint64_t *hash_ret, int *hashed_ret)
+{
+  struct ext2_copied_file key, **entry, *first, *new;
+  uint64_t hash;
+
+  key.size = statbuf->st_size;
+  key.mode = statbuf->st_mode;
+  key.uid = statbuf->st_uid;
+  key.gid = statbuf->st_gid;
+  entry = tfind (&key, &data->cache->sizes, compare_size);
+  if (entry == NULL || (!(*entry)->hashed && (*entry)->ino == 0)) {
+    *hashed_ret = 0;
+    return 0;
+  }
+
+  /* Hash the first file of this size, now that it has a candidate. */
+  first = *entry;
+  if (!first->hashed) {
+    first->hashed = 1;
+    if (ext2_hash_host_file (first->src, NULL, &hash) == 0) {
+      new = malloc (sizeof *new);
+      if (new == NULL)
+        caml_raise_out_of_memory ();
+      *new = *first;
+      new->hash = hash;
+      new->src = strdup (first->src);
+      if (new->src == NULL)
+        caml_raise_out_of_memory ();
+      cache_insert (&data->cache->contents, new, compare_content);
+    }
+  }
+
+  if (ext2_hash_host_file (src, pf, hash_ret) == -1) {
+    *hashed_ret = -1;
+    return 0;
+  }
+  *hashed_ret = 1;
+
+  key.hash = *hash_ret;
+  entry = tfind (&key, &data->cache->contents, compare_content);
+  if (entry == NULL || (*entry)->ino == 0)
+    return 0;
+
+  /* Hash collision, or the first file was changed since. */
+  if (!same_content ((*entry)->src, src))
+    return 0;
+
+  return (*entry)->ino;
 }
 
 static void
-ext2_empty_inode (ext2_filsys fs,
-                  ext2_ino_t dir_ino, const char *dirname, const char *basename,
-                  mode_t mode, uid_t uid, gid_t gid,
-                  time_t ctime, time_t atime, time_t mtime,
-                  int major, int minor, int dir_ft, ext2_ino_t *ino_ret)
+ext2_cache_add_hard_link (struct ext2_data *data, const struct stat *statbuf,
+                          ext2_ino_t ino)
 {
-  errcode_t err;
-  struct ext2_inode inode;
-  ext2_ino_t ino;
+  struct ext2_copied_file *new;
+
+  new = calloc (1, sizeof *new);
+  if (new == NULL)
+    caml_raise_out_of_memory ();
+  new->dev = statbuf->st_dev;
+  new->host_ino = statbuf->st_ino;
+  new->ino = ino;
+  cache_insert (&data->cache->hard_links, new, compare_hard_link);
+}
 
-  err = ext2fs_new_inode (fs, dir_ino, mode, 0, &ino);
-  if (err != 0)
-    ext2_error_to_exception ("ext2fs_new_inode", err, dirname);
+/* 'hashed' is as returned by ext2_cache_find_content. */
+static void
+ext2_cache_add_content (struct ext2_data *data, const struct stat *statbuf,
+                        const char *src, int hashed, uint64_t hash,
+                        ext2_ino_t ino)
+{
+  struct ext2_copied_file *new;
+
+  new = calloc (1, sizeof *new);
+  if (new == NULL)
+    caml_raise_out_of_memory ();
+  new->size = statbuf->st_size;
+  new->hash = hash;
+  new->mode = statbuf->st_mode;
+  new->uid = statbuf->st_uid;
+  new->gid = statbuf->st_gid;
+  new->src = strdup (src);
+  if (new->src == NULL)
+    caml_raise_out_of_memory ();
+  new->ino = ino;
+  if (hashed)
+    cache_insert (&data->cache->contents, new, compare_content);
+  else
+    cache_insert (&data->cache->sizes, new, compare_size);
+}
 
-  memset (&inode, 0, sizeof inode);
-  inode.i_mode = mode;
-  inode.i_uid = uid;
-  inode.i_gid = gid;
-  inode.i_blocks = 0;
-  inode.i_links_count = 1;
-  inode.i_ctime = ctime;
-  inode.i_atime = atime;
-  inode.i_mtime = mtime;
-  inode.i_size = 0;
-  inode.i_block[0] = (minor & 0xff) | (major << 8) | ((minor & ~0xff) << 12);
+/* twalk(3) has no user data parameter. */
+static ext2_ino_t forget_ino;
 
-  err = ext2fs_write_new_inode (fs, ino, &inode);
-  if (err != 0)
-    ext2_error_to_exception ("ext2fs_write_inode", err, dirname);
+static void
+forget_action (const void *nodep, VISIT which, int depth)
+{
+  struct ext2_copied_file *entry = *(struct ext2_copied_file **) nodep;
 
-  ext2_link (fs, dir_ino, basename, ino, dir_ft);
+  if ((which == postorder || which == leaf) && entry->ino == forget_ino)
+    entry->ino = 0;
+}
 
-  ext2fs_inode_alloc_stats2 (fs, ino, 1, 0);
+/* Called when an inode is freed, since the inode number may be
+ * reused by a different file afterwards.  This is rare (it only
+ * happens when a file is replaced), so a linear scan is fine.
+ */
+static void
+ext2_cache_forget_inode (struct ext2_cache *cache, ext2_ino_t ino)
+{
+  forget_ino = ino;
+  twalk (cache->hard_links, forget_action);
+  twalk (cache->contents, forget_action);
+  twalk (cache->sizes, forget_action);
+}
 
-  if (ino_ret)
-    *ino_ret = ino;
+static void
+free_copied_file (void *entryv)
+{
+  struct ext2_copied_file *entry = entryv;
+
+  free (entry->src);
+  free (entry);
 }
 
-/* Copies the file contents from the host.  You must create the file
- * first with ext2_empty_inode, and the host file must be a regular
- * file.
+static int
+compare_dir (const void *av, const void *bv)
+{
+  const struct ext2_cached_dir *a = av, *b = bv;
+
+  return strcmp (a->path, b->path);
+}
+
+/* Find or create the cache entry for the directory 'path'.  When the
+ * entry is created we canonicalize the path on the host, which is
+ * what 'readlink -f' used to do.
  */
+static struct ext2_cached_dir *
+ext2_cache_dir (struct ext2_data *data, const char *path)
+{
+  struct ext2_cached_dir key, *new, **entry;
+  struct stat stat1, stat2;
+
+  key.path = (char *) path;
+  entry = tfind (&key, &data->cache->dirs, compare_dir);
+  if (entry)
+    return *entry;
+
+  new = calloc (1, sizeof *new);
+  if (new == NULL)
+    caml_raise_out_of_memory ();
+  new->path = strdup (path);
+  if (new->path == NULL)
+    caml_raise_out_of_memory ();
+  if (lstat (path, &stat1) == 0 && S_ISLNK (stat1.st_mode) &&
+      stat (path, &stat2) == 0 && S_ISDIR (stat2.st_mode))
+    new->target = realpath (path, NULL);
+
+  entry = tsearch (new, &data->cache->dirs, compare_dir);
+  if (entry == NULL)
+    caml_raise_out_of_memory ();
+  return new;
+}
+
 static void
-ext2_write_host_file (ext2_filsys fs,
-                      ext2_ino_t ino,
-                      const char *src, /* source (host) file */
-                      const char *filename)
+forget_dir_action (const void *nodep, VISIT which, int depth)
 {
-  int fd;
-  char buf[BUFSIZ];
-  ssize_t r;
-  size_t size = 0;
-  errcode_t err;
-  ext2_file_t file;
-  unsigned int written;
+  struct ext2_cached_dir *entry = *(struct ext2_cached_dir **) nodep;
 
-  fd = open (src, O_RDONLY);
-  if (fd == -1) {
-    static int warned = 0;
+  if (which == postorder || which == leaf)
+    entry->ino = 0;
+}
 
-    /* We skip unreadable files.  However if the error is -EACCES then
-     * modify the message so as not to frighten the horses.
-     */
-    fprintf (stderr, "supermin: warning: %s: %m (ignored)\n", filename);
-    if (errno == EACCES && !warned) {
-      fprintf (stderr,
-               "Some distro files are not public readable, so supermin cannot copy them\n"
-               "into the appliance.  This is a problem with your Linux distro.  Please ask\n"
-               "your distro to stop doing pointless security by obscurity.\n"
-               "You can ignore these warnings.  You *do not* need to use sudo.\n");
-      warned = 1;
-    }
-    return;
-  }
+/* Called when a symlink or directory is removed from the filesystem,
+ * which could change the result of any lookup.  The canonical host
+ * paths are still valid.
+ */
+static void
+ext2_cache_forget_dirs (struct ext2_cache *cache)
+{
+  twalk (cache->dirs, forget_dir_action);
+}
 
-  err = ext2fs_file_open2 (fs, ino, NULL, EXT2_FILE_WRITE, &file);
-  if (err != 0)
-    ext2_error_to_exception ("ext2fs_file_open2", err, filename);
+static void
+free_cached_dir (void *entryv)
+{
+  struct ext2_cached_dir *entry = entryv;
 
-  while ((r = read (fd, buf, sizeof buf)) > 0) {
-    err = ext2fs_file_write (file, buf, r, &written);
-    if (err != 0)
-      ext2_error_to_exception ("ext2fs_file_open2", err, filename);
-    if ((ssize_t) written != r)
-      caml_failwith ("ext2fs_file_write: requested write size != bytes written");
-    size += written;
-  }
+  free (entry->path);
+  free (entry->target);
+  free (entry);
+}
 
-  if (r == -1)
-    unix_error (errno, (char *) "read", caml_copy_string (filename));
+static void
+free_name (void *entryv)
+{
+  struct ext2_name *entry = entryv;
 
-  if (close (fd) == -1)
-    unix_error (errno, (char *) "close", caml_copy_string (filename));
+  free (entry->name);
+  free (entry);
+}
 
-  /* Flush out the ext2 file. */
-  err = ext2fs_file_flush (file);
-  if (err != 0)
-    ext2_error_to_exception ("ext2fs_file_flush", err, filename);
-  err = ext2fs_file_close (file);
-  if (err != 0)
-    ext2_error_to_exception ("ext2fs_file_close", err, filename);
+static void
+free_fs_dir (void *entryv)
+{
+  struct ext2_dir *entry = entryv;
 
-  /* Update the true size in the inode. */
-  struct ext2_inode inode;
-  err = ext2fs_read_inode (fs, ino, &inode);
-  if (err != 0)
-    ext2_error_to_exception ("ext2fs_read_inode", err, filename);
-  inode.i_size = size;
-  err = ext2fs_write_inode (fs, ino, &inode);
-  if (err != 0)
-    ext2_error_to_exception ("ext2fs_write_inode", err, filename);
+  tdestroy (entry->names, free_name);
+  free (entry);
+}
+
+static void
+free_layout_file (void *entryv)
+{
+  struct ext2_layout_file *entry = entryv;
+
+  free (entry->path);
+  free (entry);
+}
+
+/* Called just before the file 'path' is written.  Release the blocks
+ * reserved for the file, if any, and return the first one as the
+ * goal for allocating the file, else ~0ULL.
+ */
+static blk64_t
+ext2_layout_claim (struct ext2_data *data, const char *path)
+{
+  struct ext2_layout_file key, **entry, *file;
+  blk64_t blk, goal;
+
+  key.path = (char *) path;
+  entry = tfind (&key, &data->cache->layout, compare_layout_file);
+  if (entry == NULL)
+    return ~0ULL;
+  file = *entry;
+  tdelete (&key, &data->cache->layout, compare_layout_file);
+
+  for (blk = file->start; blk < file->end; ++blk) {
+    if (ext2fs_test_block_bitmap2 (data->cache->layout_blocks, blk)) {
+      ext2fs_unmark_block_bitmap2 (data->cache->layout_blocks, blk);
+      ext2fs_unmark_block_bitmap2 (data->fs->block_map, blk);
+    }
+  }
+
+  goal = file->start;
+  free_layout_file (file);
+  return goal;
 }
 
-/* This is just a wrapper around ext2fs_link which calls
- * ext2fs_expand_dir as necessary if the directory fills up.  See
- * definition of expand_dir in the sources of debugfs.
+/* Release any reserved blocks which were not used (because the file
+ * was not copied, or shares an inode with another file).
  */
 static void
-ext2_link (ext2_filsys fs,
-           ext2_ino_t dir_ino, const char *basename, ext2_ino_t ino, int dir_ft)
+ext2_layout_release (struct ext2_cache *cache, ext2_filsys fs)
 {
-  errcode_t err;
+  blk64_t blk;
 
- again:
-  err = ext2fs_link (fs, dir_ino, basename, ino, dir_ft);
+  if (cache == NULL || cache->layout_blocks == NULL)
+    return;
 
-  if (err == EXT2_ET_DIR_NO_SPACE) {
-    err = ext2fs_expand_dir (fs, dir_ino);
-    if (err != 0)
-      ext2_error_to_exception ("ext2fs_expand_dir", err, basename);
-    goto again;
+  for (blk = fs->super->s_first_data_block; blk < cache->layout_end; ++blk) {
+    if (ext2fs_test_block_bitmap2 (cache->layout_blocks, blk))
+      ext2fs_unmark_block_bitmap2 (fs->block_map, blk);
   }
 
-  if (err != 0)
-    ext2_error_to_exception ("ext2fs_link", err, basename);
+  ext2fs_free_block_bitmap (cache->layout_blocks);
+  cache->layout_blocks = NULL;
+  cache->layout_end = 0;
+  tdestroy (cache->layout, free_layout_file);
+  cache->layout = NULL;
 }
 
-static int
-release_block (ext2_filsys fs, blk_t *blocknr,
-                int blockcnt, void *private)
+static void
+ext2_cache_free (struct ext2_cache *cache)
 {
-  blk_t block;
+  if (cache == NULL)
+    return;
 
-  block = *blocknr;
-  ext2fs_block_alloc_stats (fs, block, -1);
-  return 0;
+  ext2_prefetch_stop (cache);
+  tdestroy (cache->hard_links, free_copied_file);
+  tdestroy (cache->contents, free_copied_file);
+  tdestroy (cache->sizes, free_copied_file);
+  tdestroy (cache->dirs, free_cached_dir);
+  tdestroy (cache->fs_dirs, free_fs_dir);
+  free (cache);
 }
 
-/* unlink or rmdir path, if it exists. */
+/* Readers stop when the ring holds this much content.  Larger files
+ * are not read into memory, only their pages are prefetched.
+ */
+#define PREFETCH_MAX_BUFFERED (64 * 1024 * 1024)
+#define PREFETCH_MAX_FILE (4 * 1024 * 1024)
+
+/* Number of slots in the ring per reader thread. */
+#define PREFETCH_SLOTS_PER_THREAD 16
+
 static void
-ext2_clean_path (ext2_filsys fs, ext2_ino_t dir_ino,
-                 const char *dirname, const char *basename,
-                 int isdir)
+prefetch_read_file (const char *src, struct ext2_prefetched_file *slot)
 {
-  errcode_t err;
+  int fd;
+  ssize_t r;
 
-  ext2_ino_t ino;
-  err = ext2fs_lookup (fs, dir_ino, basename, strlen (basename),
-                       NULL, &ino);
-  if (err == EXT2_ET_FILE_NOT_FOUND)
+  if (lstat (src, &slot->statbuf) == -1) {
+    slot->lstat_errno = errno;
     return;
+  }
 
-  if (!isdir) {
-    struct ext2_inode inode;
-    err = ext2fs_read_inode (fs, ino, &inode);
-    if (err != 0)
-      ext2_error_to_exception ("ext2fs_read_inode", err, basename);
-    inode.i_links_count--;
-    err = ext2fs_write_inode (fs, ino, &inode);
-    if (err != 0)
-      ext2_error_to_exception ("ext2fs_write_inode", err, basename);
+  if (S_ISLNK (slot->statbuf.st_mode)) {
+    slot->content = malloc (slot->statbuf.st_size + 1);
+    if (slot->content == NULL)
+      return;
+    r = readlink (src, slot->content, slot->statbuf.st_size);
+    if (r == -1) {
+      /* Let the main thread report the error. */
+      free (slot->content);
+      slot->content = NULL;
+      return;
+    }
+    if (r > slot->statbuf.st_size)
+      r = slot->statbuf.st_size;
+    slot->content[r] = '\0';
+    slot->size = r;
+    return;
+  }
 
-    err = ext2fs_unlink (fs, dir_ino, basename, 0, 0);
-    if (err != 0)
-      ext2_error_to_exception ("ext2fs_unlink_inode", err, basename);
+  if (!S_ISREG (slot->statbuf.st_mode) || slot->statbuf.st_size == 0)
+    return;
 
-    if (inode.i_links_count == 0) {
-      inode.i_dtime = time (NULL);
-      err = ext2fs_write_inode (fs, ino, &inode);
-      if (err != 0)
-        ext2_error_to_exception ("ext2fs_write_inode", err, basename);
+  fd = open (src, O_RDONLY);
+  if (fd == -1) {
+    slot->open_errno = errno;
+    return;
+  }
 
-      if (ext2fs_inode_has_valid_blocks (&inode)) {
-	int flags = 0;
-	/* From the docs: "BLOCK_FLAG_READ_ONLY is a promise by the
-	 * caller that it will not modify returned block number."
-	 * RHEL 5 does not have this flag, so just omit it if it is
-	 * not defined.
-	 */
-#ifdef BLOCK_FLAG_READ_ONLY
-	flags |= BLOCK_FLAG_READ_ONLY;
-#endif
-        ext2fs_block_iterate (fs, ino, flags, NULL,
-                              release_block, NULL);
-      }
+  if (slot->statbuf.st_size > PREFETCH_MAX_FILE) {
+    posix_fadvise (fd, 0, 0, POSIX_FADV_WILLNEED);
+    close (fd);
+    return;
+  }
 
-      ext2fs_inode_alloc_stats2 (fs, ino, -1, isdir);
+  /* If anything goes wrong, leave it to the main thread to read the
+   * file again and report the error.
+   */
+  slot->content = malloc (slot->statbuf.st_size);
+  if (slot->content != NULL) {
+    r = full_read (fd, slot->content, slot->statbuf.st_size);
+    if (r == -1) {
+      free (slot->content);
+      slot->content = NULL;
     }
+    else
+      slot->size = r;
+  }
+  close (fd);
+}
+
+static void *
+prefetch_thread (void *pfv)
+{
+  struct ext2_prefetch *pf = pfv;
+  struct ext2_prefetched_file *slot;
+  size_t i;
+
+  pthread_mutex_lock (&pf->lock);
+  for (;;) {
+    while (!pf->stop && pf->next_read < pf->nr_srcs &&
+           (pf->next_read - pf->next_write >= pf->ring_size ||
+            pf->buffered >= PREFETCH_MAX_BUFFERED))
+      pthread_cond_wait (&pf->cond, &pf->lock);
+    if (pf->stop || pf->next_read >= pf->nr_srcs)
+      break;
+
+    i = pf->next_read++;
+    slot = &pf->ring[i % pf->ring_size];
+    pthread_mutex_unlock (&pf->lock);
+
+    prefetch_read_file (pf->srcs[i], slot);
+
+    pthread_mutex_lock (&pf->lock);
+    slot->ready = 1;
+    pf->buffered += slot->size;
+    pthread_cond_broadcast (&pf->cond);
+  }
+  pthread_mutex_unlock (&pf->lock);
+
+  return NULL;
+}
+
+static void
+ext2_prefetch_start (struct ext2_data *data, size_t nr_threads,
+                     char **srcs, size_t nr_srcs)
+{
+  struct ext2_prefetch *pf;
+  size_t i;
+  int err;
+
+  pf = calloc (1, sizeof *pf);
+  if (pf == NULL)
+    caml_raise_out_of_memory ();
+  pthread_mutex_init (&pf->lock, NULL);
+  pthread_cond_init (&pf->cond, NULL);
+  pf->srcs = srcs;
+  pf->nr_srcs = nr_srcs;
+  pf->ring_size = nr_threads * PREFETCH_SLOTS_PER_THREAD;
+  pf->ring = calloc (pf->ring_size, sizeof (struct ext2_prefetched_file));
+  pf->threads = malloc (nr_threads * sizeof (pthread_t));
+  if (pf->ring == NULL || pf->threads == NULL)
+    caml_raise_out_of_memory ();
+  data->cache->prefetch = pf;
+
+  for (i = 0; i < nr_threads; ++i) {
+    err = pthread_create (&pf->threads[i], NULL, prefetch_thread, pf);
+    if (err != 0)
+      unix_error (err, (char *) "pthread_create", Val_none);
+    pf->nr_threads++;
+  }
+}
+
+/* Release the slot that the writer was using. */
+static void
+prefetch_release (struct ext2_prefetch *pf)
+{
+  struct ext2_prefetched_file *slot;
+
+  if (!pf->holding)
+    return;
+
+  slot = &pf->ring[pf->next_write % pf->ring_size];
+  pf->buffered -= slot->size;
+  free (slot->content);
+  memset (slot, 0, sizeof *slot);
+  pf->next_write++;
+  pf->holding = 0;
+  pthread_cond_broadcast (&pf->cond);
+}
+
+/* If 'src' is the next file in the list, wait for it to be read and
+ * return it.  Otherwise return NULL and the caller must read the
+ * file itself.  The result is valid until the next call.
+ */
+static const struct ext2_prefetched_file *
+ext2_prefetch_get (struct ext2_data *data, const char *src)
+{
+  struct ext2_prefetch *pf = data->cache->prefetch;
+  struct ext2_prefetched_file *slot = NULL;
+
+  if (pf == NULL)
+    return NULL;
+
+  pthread_mutex_lock (&pf->lock);
+  prefetch_release (pf);
+  if (pf->next_write < pf->nr_srcs &&
+      strcmp (pf->srcs[pf->next_write], src) == 0) {
+    slot = &pf->ring[pf->next_write % pf->ring_size];
+    while (!slot->ready)
+      pthread_cond_wait (&pf->cond, &pf->lock);
+    pf->holding = 1;
   }
-  /* else it's a directory, what to do? XXX */
+  pthread_mutex_unlock (&pf->lock);
+
+  return slot;
+}
+
+static void
+ext2_prefetch_stop (struct ext2_cache *cache)
+{
+  struct ext2_prefetch *pf;
+  size_t i;
+
+  if (cache == NULL || cache->prefetch == NULL)
+    return;
+  pf = cache->prefetch;
+  cache->prefetch = NULL;
+
+  pthread_mutex_lock (&pf->lock);
+  pf->stop = 1;
+  pthread_cond_broadcast (&pf->cond);
+  pthread_mutex_unlock (&pf->lock);
+
+  for (i = 0; i < pf->nr_threads; ++i)
+    pthread_join (pf->threads[i], NULL);
+
+  for (i = 0; i < pf->ring_size; ++i)
+    free (pf->ring[i].content);
+  for (i = 0; i < pf->nr_srcs; ++i)
+    free (pf->srcs[i]);
+  free (pf->srcs);
+  free (pf->ring);
+  free (pf->threads);
+  pthread_cond_destroy (&pf->cond);
+  pthread_mutex_destroy (&pf->lock);
+  free (pf);
 }
 
 /* Copy a file (or directory etc) from the host. */
@@ -645,7 +2967,14 @@ ext2_copy_file (struct ext2_data *data, const char *src, const char *dest)
   if (data->debug >= 3)
     printf ("supermin: ext2: copy_file %s -> %s\n", src, dest);
 
-  if (lstat (src, &statbuf) == -1)
+  /* Was the file read ahead by a reader thread? */
+  const struct ext2_prefetched_file *pf = ext2_prefetch_get (data, src);
+  if (pf) {
+    if (pf->lstat_errno != 0)
+      unix_error (pf->lstat_errno, (char *) "lstat", caml_copy_string (src));
+    statbuf = pf->statbuf;
+  }
+  else if (lstat (src, &statbuf) == -1)
     unix_error (errno, (char *) "lstat", caml_copy_string (src));
 
   /* Check we're not about to run out of space on the output device.
@@ -710,108 +3039,127 @@ ext2_copy_file (struct ext2_data *data, const char *src, const char *dest)
 
     /* If the parent directory is a symlink to another directory, then
      * we want to look up the target directory as an absolute path
-     * (RHBZ#698089).  We really want GNU coreutils 'readlink -f' so
-     * we might as well just run it.
+     * (RHBZ#698089).  The canonical path and the inode of the
+     * directory are cached, since typically many files are copied
+     * into each directory.
      */
-    struct stat stat1, stat2;
-    if (lstat (dirname, &stat1) == 0 && S_ISLNK (stat1.st_mode) &&
-	stat (dirname, &stat2) == 0 && S_ISDIR (stat2.st_mode)) {
-      char cmd[strlen (dirname) + 100];
-      FILE *fp;
-      char *new_dirname;
-      size_t len;
-
-      /* XXX quoting, although this is from a trusted source */
-      snprintf (cmd, sizeof cmd, "readlink -f '%s'", dirname);
-      fp = popen (cmd, "r");
-      if (fp == NULL)
-	goto cont;
-      new_dirname = malloc (PATH_MAX+1);
-      if (new_dirname == NULL) {
-	pclose (fp);
-	goto cont;
-      }
-      if (fgets (new_dirname, PATH_MAX, fp) == NULL) {
-	pclose (fp);
-	free (new_dirname);
-	goto cont;
-      }
-      pclose (fp);
-
-      len = strlen (new_dirname);
-      if (len >= 1 &&
-	  new_dirname[len-1] == '\n')
-	new_dirname[len-1] = '\0';
-
+    struct ext2_cached_dir *dir = ext2_cache_dir (data, dirname);
+    if (dir->target) {
       free (dirname);
-      dirname = new_dirname;
+      dirname = strdup (dir->target);
+      if (dirname == NULL)
+        caml_raise_out_of_memory ();
     }
-  cont:
 
     /* Look up the parent directory. */
-    err = ext2fs_namei (data->fs, EXT2_ROOT_INO, EXT2_ROOT_INO, dirname, &dir_ino);
-    if (err != 0) {
-      /* This is the most popular supermin "WTF" error, so make
-       * sure we capture as much information as possible.
-       */
-      fprintf (stderr, "supermin: *** parent directory not found ***\n");
-      fprintf (stderr, "supermin: When reporting this error:\n");
-      fprintf (stderr, "supermin: please include ALL the debugging information below\n");
-      fprintf (stderr, "supermin: AND tell us what system you are running this on.\n");
-      fprintf (stderr, "     src=%s\n    dest=%s\n dirname=%s\nbasename=%s\n",
-	       src, dest, dirname, basename);
-      ext2_error_to_exception ("ext2fs_namei: parent directory not found",
-			       err, dirname);
+    if (dir->ino == 0) {
+      err = ext2_namei (data, dirname, &dir->ino);
+      if (err != 0) {
+        /* This is the most popular supermin "WTF" error, so make
+         * sure we capture as much information as possible.
+         */
+        fprintf (stderr, "supermin: *** parent directory not found ***\n");
+        fprintf (stderr, "supermin: When reporting this error:\n");
+        fprintf (stderr, "supermin: please include ALL the debugging information below\n");
+        fprintf (stderr, "supermin: AND tell us what system you are running this on.\n");
+        fprintf (stderr, "     src=%s\n    dest=%s\n dirname=%s\nbasename=%s\n",
+                 src, dest, dirname, basename);
+        dir->ino = 0;
+        ext2_error_to_exception ("ext2fs_namei: parent directory not found",
+                                 err, dirname);
+      }
     }
+    dir_ino = dir->ino;
   }
 
-  ext2_clean_path (data->fs, dir_ino, dirname, basename, S_ISDIR (statbuf.st_mode));
+  ext2_clean_path (data, dir_ino, dirname, basename, S_ISDIR (statbuf.st_mode));
 
   int dir_ft;
 
   /* Create regular file. */
   if (S_ISREG (statbuf.st_mode)) {
-    /* XXX Hard links get duplicated here. */
     ext2_ino_t ino;
+    uint64_t hash;
+    int hashed = -1;
 
-    ext2_empty_inode (data->fs, dir_ino, dirname, basename,
-                      statbuf.st_mode, statbuf.st_uid, statbuf.st_gid,
-                      statbuf.st_ctime, statbuf.st_atime, statbuf.st_mtime,
-                      0, 0, EXT2_FT_REG_FILE, &ino);
-
-    if (statbuf.st_size > 0)
-      ext2_write_host_file (data->fs, ino, src, dest);
+    /* Is this a hard link to a file we copied already, or (if
+     * deduplicating) a copy of a file with identical content?
+     */
+    ino = ext2_cache_find_hard_link (data, &statbuf);
+    if (ino == 0 && data->dedup && statbuf.st_size > 0)
+      ino = ext2_cache_find_content (data, &statbuf, src, pf, &hash, &hashed);
+
+    if (ino != 0 && ext2_link_inode (data, dir_ino, basename, ino)) {
+      if (data->debug >= 3)
+        printf ("supermin: ext2: %s shares inode %" PRIu32 "\n",
+                dest, (uint32_t) ino);
+      data->cache->inodes_saved++;
+      data->cache->bytes_saved += statbuf.st_size;
+      if (statbuf.st_nlink > 1)
+        ext2_cache_add_hard_link (data, &statbuf, ino);
+    }
+    else {
+      ext2_empty_inode (data, dir_ino, dirname, basename,
+                        statbuf.st_mode, statbuf.st_uid, statbuf.st_gid,
+                        statbuf.st_ctime, statbuf.st_atime, statbuf.st_mtime,
+                        0, 0, EXT2_FT_REG_FILE, &ino);
+
+      if (statbuf.st_size > 0)
+        ext2_write_host_file (data->fs, ino, src, dest, pf,
+                              ext2_layout_claim (data, dest));
+
+      if (statbuf.st_nlink > 1)
+        ext2_cache_add_hard_link (data, &statbuf, ino);
+      if (hashed >= 0)
+        ext2_cache_add_content (data, &statbuf, src, hashed, hash, ino);
+    }
   }
   /* Create a symlink. */
   else if (S_ISLNK (statbuf.st_mode)) {
-    char *buf = malloc (statbuf.st_size+1);
-    if (buf == NULL)
-      caml_raise_out_of_memory ();
-    ssize_t r = readlink (src, buf, statbuf.st_size);
-    if (r == -1)
-      unix_error (errno, (char *) "readlink", caml_copy_string (src));
-    if (r > statbuf.st_size)
-      r = statbuf.st_size;
-    buf[r] = '\0';
-  symlink_again:
-    err = ext2fs_symlink (data->fs, dir_ino, 0, basename, buf);
-    if (err) {
-      if (err == EXT2_ET_DIR_NO_SPACE) {
-	err = ext2fs_expand_dir (data->fs, dir_ino);
-	if (err)
-	  ext2_error_to_exception ("ext2fs_expand_dir", err, dirname);
-	goto symlink_again;
-      }
-      else
-	ext2_error_to_exception ("ext2fs_symlink", err, basename);
+    char *buf;
+    if (pf && pf->content) {
+      buf = strdup (pf->content);
+      if (buf == NULL)
+        caml_raise_out_of_memory ();
+    }
+    else {
+      buf = malloc (statbuf.st_size+1);
+      if (buf == NULL)
+        caml_raise_out_of_memory ();
+      ssize_t r = readlink (src, buf, statbuf.st_size);
+      if (r == -1)
+        unix_error (errno, (char *) "readlink", caml_copy_string (src));
+      if (r > statbuf.st_size)
+        r = statbuf.st_size;
+      buf[r] = '\0';
     }
+    /* Create the symlink without linking it, then add it to the
+     * directory ourselves.
+     */
+    ext2_ino_t ino;
+    err = ext2fs_new_inode (data->fs, dir_ino, LINUX_S_IFLNK | 0777, 0, &ino);
+    if (err != 0)
+      ext2_error_to_exception ("ext2fs_new_inode", err, basename);
+    err = ext2fs_symlink (data->fs, dir_ino, ino, NULL, buf);
+    if (err != 0)
+      ext2_error_to_exception ("ext2fs_symlink", err, basename);
+    ext2_link (data, dir_ino, basename, ino, EXT2_FT_SYMLINK);
     free (buf);
   }
   /* Create directory. */
-  else if (S_ISDIR (statbuf.st_mode))
-    ext2_mkdir (data->fs, dir_ino, dirname, basename,
-                statbuf.st_mode, statbuf.st_uid, statbuf.st_gid,
-                statbuf.st_ctime, statbuf.st_atime, statbuf.st_mtime);
+  else if (S_ISDIR (statbuf.st_mode)) {
+    struct ext2_cached_dir *dir = ext2_cache_dir (data, dest);
+    ext2_ino_t ino;
+
+    ino = ext2_mkdir (data, dir_ino, dirname, basename,
+                      statbuf.st_mode, statbuf.st_uid, statbuf.st_gid,
+                      statbuf.st_ctime, statbuf.st_atime, statbuf.st_mtime,
+                      dir->presize);
+
+    /* Save a lookup when files are copied into the new directory. */
+    if (ino != 0 && dir->target == NULL)
+      dir->ino = ino;
+  }
   /* Create a special file. */
   else if (S_ISBLK (statbuf.st_mode)) {
     dir_ft = EXT2_FT_BLKDEV;
@@ -826,7 +3174,7 @@ ext2_copy_file (struct ext2_data *data, const char *src, const char *dest)
   } else if (S_ISSOCK (statbuf.st_mode)) {
     dir_ft = EXT2_FT_SOCK;
   make_special:
-    ext2_empty_inode (data->fs, dir_ino, dirname, basename,
+    ext2_empty_inode (data, dir_ino, dirname, basename,
                       statbuf.st_mode, statbuf.st_uid, statbuf.st_gid,
                       statbuf.st_ctime, statbuf.st_atime, statbuf.st_mtime,
                       major (statbuf.st_rdev), minor (statbuf.st_rdev),
@@ -18,11 +18,19 @@
 
 type t
 
-external ext2fs_open : string -> ?debug:int -> t = "supermin_ext2fs_open"
+external ext2fs_open : string -> ?debug:int -> ?dedup:bool -> t = "supermin_ext2fs_open"
+external ext2fs_create : string -> int64 -> int64 -> int -> bool -> ?debug:int -> ?dedup:bool -> t = "supermin_ext2fs_create_byte" "supermin_ext2fs_create_native"
 external ext2fs_close : t -> unit = "supermin_ext2fs_close"
+external ext2fs_discard : t -> unit = "supermin_ext2fs_discard"
 
 external ext2fs_read_bitmaps : t -> unit = "supermin_ext2fs_read_bitmaps"
 external ext2fs_copy_file_from_host : t -> string -> string -> unit = "supermin_ext2fs_copy_file_from_host"
 external ext2fs_copy_dir_recursively_from_host : t -> string -> string -> unit = "supermin_ext2fs_copy_dir_recursively_from_host"
+external ext2fs_presize_dirs : t -> string list -> unit = "supermin_ext2fs_presize_dirs"
+external ext2fs_layout_files : t -> (string * int64) list -> unit = "supermin_ext2fs_layout_files"
+external ext2fs_prefetch_from_host : t -> int -> string list -> unit = "supermin_ext2fs_prefetch_from_host"
+external ext2fs_prefetch_stop : t -> unit = "supermin_ext2fs_prefetch_stop"
+external ext2fs_remove : t -> string -> unit = "supermin_ext2fs_remove"
 external ext2fs_chmod : t -> string -> Unix.file_perm -> unit = "supermin_ext2fs_chmod"
 external ext2fs_chown : t -> string -> int -> int -> unit = "supermin_ext2fs_chown"
+external ext2fs_utimes : t -> string -> float -> float -> float -> unit = "supermin_ext2fs_utimes"
@@ -25,11 +25,52 @@
 
 type t
 
-val ext2fs_open : string -> ?debug:int -> t
+val ext2fs_open : string -> ?debug:int -> ?dedup:bool -> t
+(** Open an existing filesystem.  Regular files that are hard links
+    on the host are always copied as a single inode.  If [~dedup:true]
+    is given, then regular files with identical content, mode and
+    ownership also share a single inode. *)
+val ext2fs_create : string -> int64 -> int64 -> int -> bool -> ?debug:int -> ?dedup:bool -> t
+(** [ext2fs_create file size inodes reserved ext4] creates a new ext2
+    filesystem in [file], which must be a newly created (sparse) file
+    of [size] bytes, and opens it.  [inodes] is the number of inodes,
+    or [0L] to choose it from the size, and [reserved] is the
+    percentage of blocks reserved for root.  If [ext4] is true, the
+    filesystem is ext4 without a journal, and files use extents.  The
+    optional arguments are as for {!ext2fs_open}.
+
+    This replaces running [mke2fs] and then {!ext2fs_open}.  The
+    metadata is only written out by {!ext2fs_close}. *)
 val ext2fs_close : t -> unit
+val ext2fs_discard : t -> unit
+(** Close the filesystem without writing any changes back to it,
+    for when the filesystem is going to be thrown away. *)
 
 val ext2fs_read_bitmaps : t -> unit
 val ext2fs_copy_file_from_host : t -> string -> string -> unit
 val ext2fs_copy_dir_recursively_from_host : t -> string -> string -> unit
+val ext2fs_presize_dirs : t -> string list -> unit
+(** [ext2fs_presize_dirs fs paths] notes that the files [paths] will
+    be copied into the filesystem, so that the directories containing
+    them are created with enough blocks for all their entries. *)
+val ext2fs_layout_files : t -> (string * int64) list -> unit
+(** [ext2fs_layout_files fs files] reserves blocks at the start of the
+    filesystem for the regular [files], given as [(path, size)] in
+    the order they should be laid out.  When each file is copied later
+    its data is placed in its reserved blocks.  Blocks which are not
+    used are released when the filesystem is closed. *)
+val ext2fs_prefetch_from_host : t -> int -> string list -> unit
+(** [ext2fs_prefetch_from_host fs jobs srcs] starts [jobs] threads
+    reading the host files [srcs] ahead, which must then be copied
+    in the same order using {!ext2fs_copy_file_from_host}.  The
+    filesystem is the same as if the files had been read serially.
+    If [jobs] is [0], this does nothing. *)
+val ext2fs_prefetch_stop : t -> unit
+(** Stop the threads started by {!ext2fs_prefetch_from_host}. *)
+val ext2fs_remove : t -> string -> unit
+(** [ext2fs_remove fs path] removes [path] from the filesystem, if it
+    exists.  Directories are only removed if they are empty. *)
 val ext2fs_chmod : t -> string -> Unix.file_perm -> unit
 val ext2fs_chown : t -> string -> int -> int -> unit
+val ext2fs_utimes : t -> string -> float -> float -> float -> unit
+(** [ext2fs_utimes fs path atime mtime ctime] sets the times of [path]. *)
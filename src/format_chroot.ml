@@ -22,14 +22,61 @@ open Printf
 
 open Utils
 open Package_handler
+open Copy_file
 
-let build_chroot debug files outputdir packagelist_file =
+let build_chroot debug files outputdir packagelist_file jobs link =
+  (* Regular files are copied in-process.  Like 'cp -p', a file
+   * which cannot be copied is reported but is not fatal.
+   *)
+  let copy_error src dest fn err =
+    eprintf "supermin: chroot: cannot copy %s to %s: %s: %s\n%!"
+      src dest fn (error_message err)
+  in
   let do_copy src dest =
+    if debug >= 2 then printf "supermin: chroot: copy %s\n%!" dest;
+    try copy_file src dest
+    with Unix_error (err, fn, _) -> copy_error src dest fn err
+  in
+
+  (* Special files are rare, so just use 'cp -p'. *)
+  let do_copy_special src dest =
     if debug >= 2 then printf "supermin: chroot: copy %s\n%!" dest;
     let cmd = sprintf "cp -p %s %s" (quote src) (quote dest) in
     ignore (Sys.command cmd)
   in
 
+  (* Regular files are queued, and copied in parallel when the queue
+   * is flushed.  Everything else is created in order by this thread,
+   * but first the queue is flushed if it has a file at the same path.
+   *)
+  let queue = ref [] and queued = Hashtbl.create 13 in
+  let flush_queue () =
+    if !queue <> [] then (
+      let copies = List.rev !queue in
+      queue := [];
+      Hashtbl.clear queued;
+      if debug >= 2 then
+        List.iter (
+          fun (_, dest) ->
+            printf "supermin: chroot: %s %s\n"
+              (if link then "link" else "copy") dest
+        ) copies;
+      let errors = copy_files jobs link copies in
+      let copies = Array.of_list copies in
+      List.iter (
+        fun (i, fn, err) ->
+          let src, dest = copies.(i) in
+          copy_error src dest fn err
+      ) errors
+    )
+  in
+  let before_create opath =
+    if Hashtbl.mem queued opath then flush_queue ()
+  in
+
+  if debug >= 1 then
+    printf "supermin: chroot: copying files with %d threads\n%!" (max jobs 1);
+
   List.iter (
     fun file ->
       try
@@ -42,6 +89,7 @@ let build_chroot debug files outputdir packagelist_file =
            * pass, otherwise we risk creating a directory that we are
            * unable to write inside.  GNU tar does the same thing!
            *)
+          before_create opath;
           if debug >= 2 then printf "supermin: chroot: mkdir %s\n%!" opath;
           mkdir opath 0o700
 
@@ -61,15 +109,25 @@ let build_chroot debug files outputdir packagelist_file =
               !link
             ) in
 
+          before_create opath;
           if debug >= 2 then
             printf "supermin: chroot: link %s -> %s\n%!" opath link;
           symlink link opath
 
-        | S_REG | S_CHR | S_BLK | S_FIFO | S_SOCK ->
-          do_copy path opath
+        | S_REG ->
+          before_create opath;
+          queue := (path, opath) :: !queue;
+          Hashtbl.replace queued opath ()
+
+        | S_CHR | S_BLK | S_FIFO | S_SOCK ->
+          before_create opath;
+          do_copy_special path opath
       with Unix_error _ -> ()
   ) files;
 
+  (* All files must be copied before the permissions are fixed up. *)
+  flush_queue ();
+
   (* Add packagelist file, if requested. *)
   (match packagelist_file with
   | None -> ()
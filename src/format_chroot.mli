@@ -18,8 +18,12 @@
 
 (** Implements [--build -f chroot]. *)
 
-val build_chroot : int -> Package_handler.file list -> string -> string option -> unit
-(** [build_chroot debug files outputdir packagelist_file] copies the
+val build_chroot : int -> Package_handler.file list -> string -> string option -> int -> bool -> unit
+(** [build_chroot debug files outputdir packagelist_file jobs link] copies the
     list of [files] into the chroot at [outputdir].  The optional
     [packagelist] controls creation of [/packagelist] within the
-    chroot. *)
+    chroot.
+
+    Regular files are copied by [jobs] threads.  The chroot is the
+    same whatever the number of threads.  If [link] is true, they
+    are hard linked instead where possible. *)
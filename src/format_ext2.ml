@@ -20,6 +20,7 @@ open Unix
 open Unix.LargeFile
 open Printf
 
+open Types
 open Utils
 open Ext2fs
 open Package_handler
@@ -35,49 +36,175 @@ open Package_handler
  *)
 let default_appliance_size = 4L *^ 1024L *^ 1024L *^ 1024L
 
-let build_ext2 debug basedir files modpath kernel_version appliance size
-    packagelist_file =
-  if debug >= 1 then
-    printf "supermin: ext2: creating empty ext2 filesystem '%s'\n%!" appliance;
+(* Block size and inode size of the filesystems created by
+ * Ext2fs.ext2fs_create, used for --size auto.
+ *)
+let block_size = 4096L
+let inode_size = 256L
 
-  let fd = openfile appliance [O_WRONLY;O_CREAT;O_TRUNC;O_NOCTTY] 0o644 in
-  let size =
-    match size with
-    | None -> default_appliance_size
-    | Some s -> s in
-  LargeFile.ftruncate fd size;
-  close fd;
+(* Estimate of the blocks and inodes needed by the files we will
+ * copy into the filesystem.  Hard links and --dedup only ever make
+ * the result smaller, so we ignore them.
+ *)
+type usage = {
+  mutable inodes : int64;
+  mutable blocks : int64;
+  mutable dirent_bytes : int64;         (* size of all directory entries *)
+}
 
-  let cmd =
-    sprintf "%s %s ext2 -F%s %s"
-      Config.mke2fs Config.mke2fs_t_option
-      (if debug >= 2 then "" else "q")
-      (quote appliance) in
-  run_command cmd;
+let add_usage usage name st =
+  usage.inodes <- usage.inodes +^ 1L;
+  (* A directory entry is 8 bytes plus the name, padded to 4 bytes. *)
+  usage.dirent_bytes <-
+    usage.dirent_bytes +^ Int64.of_int ((8 + String.length name + 3) land (-4));
+  let blocks =
+    match st.st_kind with
+    | S_REG ->
+      let data = (st.st_size +^ block_size -^ 1L) /^ block_size in
+      (* Indirect blocks, past the 12 direct blocks in the inode. *)
+      if data > 12L then data +^ data /^ 1024L +^ 3L else data
+    | S_DIR -> 1L
+    | S_LNK when st.st_size >= 60L -> 1L  (* else stored in the inode *)
+    | _ -> 0L in
+  usage.blocks <- usage.blocks +^ blocks
 
-  let fs = ext2fs_open ~debug appliance in
-  ext2fs_read_bitmaps fs;
+let rec add_usage_recursively usage path =
+  match (try Some (lstat path) with Unix_error _ -> None) with
+  | None -> ()
+  | Some st ->
+    add_usage usage (Filename.basename path) st;
+    if st.st_kind = S_DIR then (
+      let names = try Sys.readdir path with Sys_error _ -> [||] in
+      Array.iter (fun name -> add_usage_recursively usage (path // name)) names
+    )
 
-  if debug >= 1 then
-    printf "supermin: ext2: populating from base image\n%!";
+(* Choose the size and number of inodes of the filesystem to fit
+ * 'usage', plus 'headroom' percent.  Returns (size, inodes).
+ *)
+let auto_geometry usage headroom =
+  let with_headroom n = n +^ n *^ Int64.of_int headroom /^ 100L in
+  (* The first 11 inodes are reserved. *)
+  let inodes = with_headroom (usage.inodes +^ 11L) in
+  let data_blocks =
+    with_headroom (usage.blocks +^ usage.dirent_bytes /^ block_size) in
+  let inode_table_blocks = inodes *^ inode_size /^ block_size +^ 1L in
+  (* Each group of 32768 blocks has a superblock backup, group
+   * descriptors, two bitmaps, and some slack because the inode table
+   * is rounded up to whole blocks in each group.  Also allow 1 MB for
+   * the boot block, root directory and lost+found etc.
+   *)
+  let groups = (data_blocks +^ inode_table_blocks) /^ 32768L +^ 1L in
+  let blocks =
+    data_blocks +^ inode_table_blocks +^ groups *^ 8L +^
+      1024L *^ 1024L /^ block_size in
+  (* Round up to a whole megabyte. *)
+  let mb = 1024L *^ 1024L in
+  let size = (blocks *^ block_size +^ mb -^ 1L) /^ mb *^ mb in
+  size, inodes
 
-  (* Read files from the base image, which has been unpacked into a
-   * directory for us.
+(* Read the list of paths recorded by --layout-trace, and find the
+ * host file that each one is copied from.  Returns the regular files
+ * in the order they were first read, with their sizes.
+ *)
+let read_layout_trace debug filename basedir files modpath kernel_version =
+  let chan = open_in filename in
+  let paths = input_all_lines chan in
+  close_in chan;
+
+  let sources = Hashtbl.create (List.length files) in
+  List.iter (
+    fun file -> Hashtbl.replace sources file.ft_path (file_source file)
+  ) files;
+  let modules_dir = "/lib/modules/" ^ kernel_version ^ "/" in
+
+  (* The same precedence as the order the files are copied in below:
+   * kernel modules, then host files, then the base image.
    *)
-  ext2fs_copy_dir_recursively_from_host fs basedir "/";
+  let source path =
+    if string_prefix modules_dir path then (
+      let n = String.length modules_dir in
+      Some (modpath // String.sub path n (String.length path - n))
+    )
+    else if Hashtbl.mem sources path then
+      Some (Hashtbl.find sources path)
+    else if Sys.file_exists (basedir ^ path) then
+      Some (basedir ^ path)
+    else
+      None in
+
+  let seen = Hashtbl.create 13 in
+  let layout = filter_map (
+    fun path ->
+      (* Also skips blank lines and comments. *)
+      if String.length path = 0 || path.[0] <> '/' ||
+           Hashtbl.mem seen path then None
+      else (
+        Hashtbl.add seen path ();
+        match source path with
+        | None -> None
+        | Some src ->
+          try
+            let st = lstat src in
+            if st.st_kind = S_REG && st.st_size > 0L then
+              Some (path, st.st_size)
+            else None
+          with Unix_error _ -> None
+      )
+  ) paths in
 
   if debug >= 1 then
-    printf "supermin: ext2: copying files from host filesystem\n%!";
+    printf "supermin: ext2: %d files in layout trace %s\n%!"
+      (List.length layout) filename;
+  layout
 
-  (* Copy files from host filesystem. *)
+(* The manifest records the host files that went into the appliance,
+ * so the next build can tell which of them have changed.  Each line
+ * is the state of the host file, a tab, and the path in the
+ * appliance.
+ *)
+let manifest_version = "supermin-manifest 1"
+
+let manifest_entry file =
+  try
+    let st = lstat (file_source file) in
+    Some (sprintf "%c %d %d %Ld %.9f %.9f"
+            (if st.st_kind = S_DIR then 'd' else '-')
+            st.st_dev st.st_ino st.st_size st.st_mtime st.st_ctime)
+  with Unix_error _ -> None
+
+let write_manifest filename key files =
+  let chan = open_out filename in
+  fprintf chan "%s\nkey %s\n" manifest_version key;
   List.iter (
     fun file ->
-      let src = file_source file in
-      ext2fs_copy_file_from_host fs src file.ft_path
+      match manifest_entry file with
+      | None -> ()
+      | Some entry -> fprintf chan "%s\t%s\n" entry file.ft_path
   ) files;
+  close_out chan
 
-  (* Add packagelist file, if requested. *)
-  (match packagelist_file with
+(* Returns the key and a hash of path -> entry, or None if the
+ * manifest was written by a different version.
+ *)
+let read_manifest filename =
+  let chan = open_in filename in
+  let lines = input_all_lines chan in
+  close_in chan;
+  match lines with
+  | version :: key :: entries
+      when version = manifest_version && string_prefix "key " key ->
+    let key = String.sub key 4 (String.length key - 4) in
+    let manifest = Hashtbl.create (List.length entries) in
+    List.iter (
+      fun line ->
+        let i = String.index line '\t' in
+        let path = String.sub line (i+1) (String.length line - i - 1) in
+        Hashtbl.replace manifest path (String.sub line 0 i)
+    ) entries;
+    Some (key, manifest)
+  | _ -> None
+
+let copy_packagelist debug fs = function
   | None -> ()
   | Some filename ->
     if debug >= 1 then
@@ -89,8 +216,259 @@ let build_ext2 debug basedir files modpath kernel_version appliance size
      *)
     ext2fs_chmod fs "/packagelist" 0o644;
     ext2fs_chown fs "/packagelist" 0 0
+
+(* Make 'appliance' from a copy of the previous appliance, rewriting
+ * only the files which are not the same as in 'old_manifest'.
+ * Returns false if the appliance must be built from scratch instead.
+ *)
+let update_ext2 debug basedir files appliance packagelist_file jobs
+    previous old_manifest =
+  let manifest = Hashtbl.create (List.length files) in
+  List.iter (
+    fun file ->
+      match manifest_entry file with
+      | None -> ()
+      | Some entry -> Hashtbl.replace manifest file.ft_path entry
+  ) files;
+  let is_dir entry = entry.[0] = 'd' in
+
+  (* Remove the files which have gone, and paths which have changed
+   * between being a directory and something else.  Removing in
+   * reverse order means the contents of a directory are removed
+   * before the directory.
+   *)
+  let removed = Hashtbl.fold (
+    fun path old_entry removed ->
+      try
+        let entry = Hashtbl.find manifest path in
+        if is_dir old_entry <> is_dir entry then path :: removed
+        else removed
+      with Not_found -> path :: removed
+  ) old_manifest [] in
+  let removed = List.rev (List.sort compare removed) in
+
+  let changed = List.filter (
+    fun file ->
+      try
+        Hashtbl.find manifest file.ft_path <>
+          Hashtbl.find old_manifest file.ft_path
+      with Not_found -> Hashtbl.mem manifest file.ft_path
+  ) files in
+
+  (* Hard links are only found between files copied in the same run,
+   * so a changed file which is a hard link on the host may have to
+   * share an inode with a file already in the previous appliance.
+   *)
+  let hard_linked = List.exists (
+    fun file ->
+      try
+        let st = lstat (file_source file) in
+        st.st_kind = S_REG && st.st_nlink > 1
+      with Unix_error _ -> false
+  ) changed in
+
+  if hard_linked then (
+    if debug >= 1 then
+      printf "supermin: ext2: hard linked files have changed\n%!";
+    false
+  )
+  else (
+    if debug >= 1 then
+      printf "supermin: ext2: updating previous appliance '%s'\n%!" previous;
+
+    run_command (sprintf "cp --reflink=auto --sparse=always %s %s"
+                   (quote previous) (quote appliance));
+    let fs = ext2fs_open ~debug appliance in
+    (try
+       ext2fs_read_bitmaps fs;
+
+       List.iter (
+         fun path ->
+           if debug >= 2 then
+             printf "supermin: ext2: removing %s\n%!" path;
+           ext2fs_remove fs path;
+           (* Put back the file from the base image, if it had one. *)
+           if not (Hashtbl.mem manifest path) &&
+                (try ignore (lstat (basedir ^ path)); true
+                 with Unix_error (ENOENT, _, _) -> false) then
+             ext2fs_copy_file_from_host fs (basedir ^ path) path
+       ) removed;
+
+       if debug >= 1 then
+         printf "supermin: ext2: %d files removed, %d added or changed\n%!"
+           (List.length removed) (List.length changed);
+
+       ext2fs_prefetch_from_host fs jobs (List.map file_source changed);
+       (try
+          List.iter (
+            fun file ->
+              let src = file_source file in
+              if debug >= 2 then
+                printf "supermin: ext2: updating %s\n%!" file.ft_path;
+              let old_entry =
+                try Some (Hashtbl.find old_manifest file.ft_path)
+                with Not_found -> None in
+              match old_entry with
+              | Some old_entry
+                  when is_dir old_entry &&
+                         is_dir (Hashtbl.find manifest file.ft_path) ->
+                (* The directory still exists, so just update it. *)
+                let st = lstat src in
+                ext2fs_chmod fs file.ft_path st.st_perm;
+                ext2fs_chown fs file.ft_path st.st_uid st.st_gid;
+                ext2fs_utimes fs file.ft_path
+                  st.st_atime st.st_mtime st.st_ctime
+              | _ ->
+                ext2fs_copy_file_from_host fs src file.ft_path
+          ) changed
+        with exn ->
+          ext2fs_prefetch_stop fs;
+          raise exn
+       );
+       ext2fs_prefetch_stop fs;
+
+       copy_packagelist debug fs packagelist_file;
+
+       ext2fs_close fs;
+       true
+     with exn ->
+       (* Don't let the handle write anything back to the partial
+        * appliance, and remove it so it is rebuilt from scratch.
+        *)
+       ext2fs_discard fs;
+       (try unlink appliance with Unix_error _ -> ());
+       raise exn
+    )
+  )
+
+let rec build_ext2 debug basedir files modpath kernel_version appliance size
+    packagelist_file dedup jobs ext4 layout_trace manifest key previous =
+  (* Try to update the previous appliance.  If it was built by a
+   * different version of supermin, or from different inputs, or if
+   * anything goes wrong, fall back to building from scratch.  Files
+   * which are shared by --dedup can't be tracked by the manifest, so
+   * the appliance is always built from scratch then.
+   *)
+  let updated =
+    match previous with
+    | Some (previous, old_manifest) when layout_trace = None && not dedup ->
+      (try
+         match read_manifest old_manifest with
+         | Some (old_key, old_manifest) when old_key = key ->
+           update_ext2 debug basedir files appliance packagelist_file jobs
+             previous old_manifest
+         | _ ->
+           if debug >= 1 then
+             printf "supermin: ext2: previous appliance is out of date\n%!";
+           false
+       with exn ->
+         if debug >= 1 then
+           printf "supermin: ext2: could not update previous appliance: %s\n%!"
+             (Printexc.to_string exn);
+         false
+      )
+    | _ -> false in
+
+  if not updated then
+    create_ext2 debug basedir files modpath kernel_version appliance size
+      packagelist_file dedup jobs ext4 layout_trace;
+
+  write_manifest manifest key files
+
+and create_ext2 debug basedir files modpath kernel_version appliance size
+    packagelist_file dedup jobs ext4 layout_trace =
+  (* Returns the size, number of inodes (or 0L for the default) and
+   * percentage of reserved blocks.
+   *)
+  let size, inodes, reserved =
+    match size with
+    | None -> default_appliance_size, 0L, 5
+    | Some (Size size) -> size, 0L, 5
+    | Some (Auto_size headroom) ->
+      if debug >= 1 then
+        printf "supermin: ext2: estimating size of the filesystem\n%!";
+      let usage = { inodes = 0L; blocks = 0L; dirent_bytes = 0L } in
+      add_usage_recursively usage basedir;
+      List.iter (
+        fun file ->
+          try
+            let st = lstat (file_source file) in
+            add_usage usage (Filename.basename file.ft_path) st
+          with Unix_error _ -> ()
+      ) files;
+      (match packagelist_file with
+      | None -> ()
+      | Some filename -> add_usage_recursively usage filename
+      );
+      (* /lib and /lib/modules directories, then the modules. *)
+      usage.inodes <- usage.inodes +^ 2L;
+      usage.blocks <- usage.blocks +^ 2L;
+      add_usage_recursively usage modpath;
+      let size, inodes = auto_geometry usage headroom in
+      if debug >= 1 then
+        printf "supermin: ext2: size %Ld bytes, %Ld inodes (%Ld bytes and %Ld inodes needed)\n%!"
+          size inodes
+          (usage.blocks *^ block_size) usage.inodes;
+      size, inodes, 0 in
+
+  if debug >= 1 then
+    printf "supermin: ext2: creating empty %s filesystem '%s'\n%!"
+      (if ext4 then "ext4" else "ext2") appliance;
+
+  let fd = openfile appliance [O_WRONLY;O_CREAT;O_TRUNC;O_NOCTTY] 0o644 in
+  LargeFile.ftruncate fd size;
+  close fd;
+
+  let fs = ext2fs_create appliance size inodes reserved ext4 ~debug ~dedup in
+
+  (* Reserve the start of the filesystem for the files that are read
+   * at boot, so they are laid out contiguously in the order they are
+   * read.
+   *)
+  (match layout_trace with
+  | None -> ()
+  | Some filename ->
+    let layout =
+      read_layout_trace debug filename basedir files modpath kernel_version in
+    ext2fs_layout_files fs layout
   );
 
+  (* Tell the library how many entries each directory will have, so
+   * it can allocate the directory blocks in one go.
+   *)
+  ext2fs_presize_dirs fs (List.map (fun file -> file.ft_path) files);
+
+  if debug >= 1 then
+    printf "supermin: ext2: populating from base image\n%!";
+
+  (* Read files from the base image, which has been unpacked into a
+   * directory for us.
+   *)
+  ext2fs_copy_dir_recursively_from_host fs basedir "/";
+
+  if debug >= 1 then
+    printf "supermin: ext2: copying files from host filesystem\n%!";
+
+  (* Copy files from host filesystem.  The host files are read ahead
+   * in parallel, but they are still written to the filesystem in
+   * order by this thread.
+   *)
+  ext2fs_prefetch_from_host fs jobs (List.map file_source files);
+  (try
+     List.iter (
+       fun file ->
+         let src = file_source file in
+         ext2fs_copy_file_from_host fs src file.ft_path
+     ) files
+   with exn ->
+     ext2fs_prefetch_stop fs;
+     raise exn
+  );
+  ext2fs_prefetch_stop fs;
+
+  (* Add packagelist file, if requested. *)
+  copy_packagelist debug fs packagelist_file;
+
   if debug >= 1 then
     printf "supermin: ext2: copying kernel modules\n%!";
 
@@ -18,10 +18,29 @@
 
 (** Implements [--build -f chroot]. *)
 
-val build_ext2 : int -> string -> Package_handler.file list -> string -> string -> string -> int64 option -> string option -> unit
+val build_ext2 : int -> string -> Package_handler.file list -> string -> string -> string -> Types.size option -> string option -> bool -> int -> bool -> string option -> string -> string -> (string * string) option -> unit
 (** [build_ext2 debug basedir files modpath kernel_version appliance size
-    packagelist_file] copies all the files from [basedir] plus the
+    packagelist_file dedup jobs ext4 layout_trace manifest key previous] copies all the files from [basedir] plus the
     list of [files] into a newly created ext2 filesystem called [appliance].
+    If [ext4] is true, the filesystem is ext4 (without a journal)
+    instead.
+
+    If [dedup] is true, regular files with identical content share
+    a single inode.
+
+    [jobs] threads are used to read the list of [files] from the host
+    ahead of writing them, or [0] to read them serially.
+
+    If [layout_trace] is given, it is a file listing the paths in the
+    appliance in the order they are read at boot.  Those files are
+    placed contiguously at the start of the filesystem in that order.
+
+    A [manifest] of the host files which were copied is written,
+    labelled with [key].  [key] should identify all the other inputs
+    to the appliance.  If [previous] is given, it is the
+    [(appliance, manifest)] of a previous build.  If that has the same
+    key, [appliance] is made by copying it and rewriting just the files
+    which have changed, instead of building from scratch.
 
     Kernel modules are also copied in from the local [modpath]
     to the fixed path in the appliance [/lib/modules/<kernel_version>].
@@ -23,6 +23,7 @@ open Printf
 open Utils
 open Ext2fs
 open Fnmatch
+open Cpio
 
 module StringSet = Set.Make (String)
 module StringMap = Map.Make (String)
@@ -59,12 +60,80 @@ let not_kmods = [
   "virtio-gpu.ko*";
 ]
 
-let rec build_initrd debug tmpdir modpath initrd =
+(* Compressed kernel modules, and the program used to decompress
+ * them if supermin cannot do it in-process.
+ *)
+let decompressors = [
+  ".zst", Config.zstdcat;
+  ".xz", Config.xzcat;
+  ".gz", Config.zcat;
+]
+
+let rec build_initrd debug tmpdir modpath kernel_version initrd
+    compressed_modules cache_dir =
+  (* The initrd only depends on the kernel modules and supermin
+   * itself, so it can be reused from the cache directory when
+   * building more appliances for the same kernel.
+   *)
+  let cached =
+    match cache_dir with
+    | None -> None
+    | Some dir ->
+      let key = initrd_cache_key modpath kernel_version compressed_modules in
+      Some (dir // ("initrd-" ^ key)) in
+
+  match cached with
+  | Some cached when Sys.file_exists cached ->
+    if debug >= 1 then
+      printf "supermin: ext2: using cached initrd '%s'\n%!" cached;
+    (* Don't hard link it, so that the output and the cache can't
+     * change each other.
+     *)
+    Copy_file.copy_file cached initrd;
+    (* Make the initrd appear new, for --if-newer. *)
+    utimes initrd 0. 0.
+
+  | _ ->
+    write_initrd debug tmpdir modpath kernel_version initrd
+                 compressed_modules;
+    match cached with
+    | None -> ()
+    | Some cached ->
+      (* Failing to update the cache is not fatal.  Other instances
+       * of supermin may be filling the cache at the same time, so
+       * add the initrd under a temporary name and rename it.
+       *)
+      try
+        (try mkdir (Filename.dirname cached) 0o755
+         with Unix_error (EEXIST, _, _) -> ());
+        let tmpfile = cached ^ "." ^ string_random8 () in
+        Copy_file.copy_file initrd tmpfile;
+        rename tmpfile cached;
+        if debug >= 1 then
+          printf "supermin: ext2: saved initrd in cache '%s'\n%!" cached
+      with Unix_error (err, fn, _) ->
+        eprintf "supermin: warning: could not save initrd in cache: %s: %s\n%!"
+                fn (error_message err)
+
+and write_initrd debug tmpdir modpath kernel_version initrd
+    compressed_modules =
   if debug >= 1 then
     printf "supermin: ext2: creating minimal initrd '%s'\n%!" initrd;
 
-  let initdir = tmpdir // "init.d" in
-  mkdir initdir 0o755;
+  (* The compressed modules which the kernel can load itself. *)
+  let kernel_compression =
+    if not compressed_modules then None
+    else (
+      let compression = kernel_module_compression modpath kernel_version in
+      if debug >= 1 then (
+        match compression with
+        | None ->
+          printf "supermin: ext2: kernel cannot load compressed modules\n%!"
+        | Some suffix ->
+          printf "supermin: ext2: kernel can load %s modules\n%!" suffix
+      );
+      compression
+    ) in
 
   (* Read modules.dep file. *)
   let moddeps = read_module_deps modpath in
@@ -87,9 +156,12 @@ let rec build_initrd debug tmpdir modpath initrd =
 
   (* Do depth-first search to locate the modules we need to load.  Keep
    * track of which modules we've added so we don't add them twice.
+   * Each module becomes an entry in the initrd, in the order they
+   * must be loaded.
    *)
   let visited = ref StringSet.empty in
-  let chan = open_out (initdir // "modules") in
+  let entries = ref [] and modules = ref [] in
+  let basenames = ref StringMap.empty in
   let rec visit set =
     StringSet.iter (
       fun modl ->
@@ -105,81 +177,101 @@ let rec build_initrd debug tmpdir modpath initrd =
             with Not_found -> StringSet.empty in
           visit deps;
 
-          (* Copy module to the init directory.
-           * Uncompress the module, if the name ends in .zst, .xz or .gz.
+          (* Uncompress the module, if the name ends in .zst, .xz or
+           * .gz, unless the kernel can load it compressed.  This is
+           * done while writing the initrd if possible, else using an
+           * external program.
            *)
+          let src = modpath // modl in
           let basename = Filename.basename modl in
-          let basename =
-            let len = String.length basename in
-            if Config.zstdcat <> "no" &&
-                 Filename.check_suffix basename ".zst"
-            then (
-              let basename = String.sub basename 0 (len-4) in
-              let cmd = sprintf "%s %s > %s"
-                                (quote Config.zstdcat)
-                                (quote (modpath // modl))
-                                (quote (initdir // basename)) in
-              if debug >= 2 then printf "supermin: %s\n" cmd;
-              run_command cmd;
-              basename
-            )
-            else if Config.xzcat <> "no" &&
-                 Filename.check_suffix basename ".xz"
-            then (
-              let basename = String.sub basename 0 (len-3) in
-              let cmd = sprintf "%s %s > %s"
-                                (quote Config.xzcat)
-                                (quote (modpath // modl))
-                                (quote (initdir // basename)) in
-              if debug >= 2 then printf "supermin: %s\n" cmd;
-              run_command cmd;
-              basename
-            )
-            else if Config.zcat <> "no" &&
-                      Filename.check_suffix basename ".gz"
-            then (
-              let basename = String.sub basename 0 (len-3) in
+          let compressed =
+            List.filter (
+              fun (suffix, _) -> Filename.check_suffix basename suffix
+            ) decompressors in
+          let basename, entry =
+            match compressed with
+            | (suffix, _) :: _ when Some suffix = kernel_compression ->
+              basename, Host_file (basename, 0o644, src, false)
+            | (suffix, _) :: _ when cpio_can_decompress src ->
+              let basename = Filename.chop_suffix basename suffix in
+              basename, Host_file (basename, 0o644, src, true)
+            | (suffix, prog) :: _ when prog <> "no" ->
+              let basename = Filename.chop_suffix basename suffix in
+              let tmpfile = tmpdir // basename in
               let cmd = sprintf "%s %s > %s"
-                                (quote Config.zcat)
-                                (quote (modpath // modl))
-                                (quote (initdir // basename)) in
-              if debug >= 2 then printf "supermin: %s\n" cmd;
-              run_command cmd;
-              basename
-            )
-            else (
-              let cmd =
-                sprintf "cp -t %s %s"
-                        (quote initdir) (quote (modpath // modl)) in
+                                (quote prog) (quote src) (quote tmpfile) in
               if debug >= 2 then printf "supermin: %s\n" cmd;
               run_command cmd;
-              basename
-            ) in
+              basename, Host_file (basename, 0o644, tmpfile, false)
+            | _ ->
+              basename, Host_file (basename, 0o644, src, false) in
+          entries := entry :: !entries;
 
-          (* Write module name to 'modules' file. *)
-          fprintf chan "%s\n" basename;
+          (* Write module name and the names of the modules it
+           * depends on to 'modules' file.  The init uses this to
+           * load independent modules in parallel.
+           *)
+          basenames := StringMap.add modl basename !basenames;
+          let deps =
+            filter_map (
+              fun dep ->
+                try Some (StringMap.find dep !basenames)
+                with Not_found -> None
+            ) (StringSet.elements deps) in
+          modules := String.concat " " (basename :: deps) :: !modules
         )
     ) set
   in
   visit topset;
-  close_out chan;
+  let entries = List.rev !entries in
 
   if debug >= 1 then
     printf "supermin: ext2: wrote %d modules to minimal initrd\n%!" (StringSet.cardinal !visited);
 
+  let modules = List.rev_map (fun basename -> basename ^ "\n") !modules in
+  let modules = String.concat "" modules in
+
   (* This is the binary blob containing the init "script". *)
   let init = Format_ext2_init.binary_init () in
-  let initfile = initdir // "init" in
-  let chan = open_out initfile in
-  output_string chan init;
-  close_out chan;
-  chmod initfile 0o755;
-
-  (* Build the cpio file. *)
-  let cmd =
-    sprintf "(cd %s && (echo .; ls -1) | cpio --quiet -o -H newc) > %s"
-      (quote initdir) (quote initrd) in
-  run_command cmd
+
+  (* Write the cpio file. *)
+  cpio_write initrd ([ Directory (".", 0o755);
+                       File ("init", 0o755, init);
+                       File ("modules", 0o644, modules) ] @ entries)
+
+(* The cache key covers everything which affects the contents of
+ * the initrd: the kernel modules, the modules selected from them,
+ * and the init program.
+ *)
+and initrd_cache_key modpath kernel_version compressed_modules =
+  let modules_dep = stat (modpath // "modules.dep") in
+  let key = [ Config.package_version; modpath; kernel_version;
+              sprintf "%Ld %.9f" modules_dep.st_size modules_dep.st_mtime;
+              String.concat " " kmods; String.concat " " not_kmods;
+              string_of_bool compressed_modules;
+              Digest.to_hex (Digest.string (Format_ext2_init.binary_init ()))
+            ] in
+  Digest.to_hex (Digest.string (String.concat "\n" key))
+
+(* If the kernel can decompress modules itself (Linux >= 5.17 with
+ * CONFIG_MODULE_DECOMPRESS), return the suffix of the compressed
+ * modules it can load.  It only supports the compression method
+ * that it was configured to compress modules with.
+ *)
+and kernel_module_compression modpath kernel_version =
+  let configs = [ modpath // "config"; "/boot/config-" ^ kernel_version ] in
+  match List.filter Sys.file_exists configs with
+  | [] -> None
+  | config :: _ ->
+    let chan = open_in config in
+    let lines = input_all_lines chan in
+    close_in chan;
+    let enabled opt = List.mem (opt ^ "=y") lines in
+    if not (enabled "CONFIG_MODULE_DECOMPRESS") then None
+    else if enabled "CONFIG_MODULE_COMPRESS_ZSTD" then Some ".zst"
+    else if enabled "CONFIG_MODULE_COMPRESS_XZ" then Some ".xz"
+    else if enabled "CONFIG_MODULE_COMPRESS_GZIP" then Some ".gz"
+    else None
 
 (* Read modules.dep into internal structure. *)
 and read_module_deps modpath =
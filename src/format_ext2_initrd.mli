@@ -21,11 +21,18 @@
 
     See also the {!Format_ext2} module. *)
 
-val build_initrd : int -> string -> string -> string -> unit
-(** [build_initrd debug tmpdir modpath initrd] creates the minimal
-    initrd required to mount the ext2 filesystem at runtime.
+val build_initrd : int -> string -> string -> string -> string -> bool -> string option -> unit
+(** [build_initrd debug tmpdir modpath kernel_version initrd compressed_modules cache_dir]
+    creates the minimal initrd required to mount the ext2 filesystem
+    at runtime.
 
     A small, whitelisted selection of kernel modules is taken
-    from [modpath], just enough to mount the appliance.
+    from [modpath], just enough to mount the appliance.  Compressed
+    modules are decompressed, unless [compressed_modules] is true and
+    the kernel can load them compressed.
 
-    The output is the file [initrd]. *)
+    The output is the file [initrd].
+
+    If [cache_dir] is given, the initrd is saved there, and later
+    builds for the same kernel hard link or copy it from the cache
+    instead of creating it again. *)
@@ -469,6 +469,178 @@ supermin_rpm_pkg_filelist (value rpmv, value pkgv)
   CAMLreturn (rv);
 }
 
+static int
+compare_strings (const void *av, const void *bv)
+{
+  const char *a = *(const char **) av;
+  const char *b = *(const char **) bv;
+  return strcmp (a, b);
+}
+
+/* Copy a string array tag from a header to an OCaml string array.
+ * A missing tag is returned as an empty array.
+ */
+static value
+copy_string_array_tag (Header h, rpmTagVal tag, rpmtd td)
+{
+  CAMLparam0 ();
+  CAMLlocal1 (rv);
+  int i, n;
+
+  if (headerGet (h, tag, td, HEADERGET_MINMEM) != 1)
+    CAMLreturn (caml_alloc (0, 0));
+
+  n = rpmtdCount (td);
+  rv = caml_alloc (n, 0);
+  for (i = 0; i < n; ++i)
+    Store_field (rv, i, caml_copy_string (rpmtdNextString (td)));
+  rpmtdFreeData (td);
+
+  CAMLreturn (rv);
+}
+
+/* Read everything needed to resolve dependencies from the database
+ * in one go, instead of querying it for each package and requirement.
+ *
+ * This returns the list of all installed packages with their requires
+ * and provides, and the packages owning each file which is required
+ * by any package.  The files are looked up in the file index of the
+ * database, which is much cheaper than reading the file lists of all
+ * the packages.
+ */
+value
+supermin_rpm_index (value rpmv)
+{
+  CAMLparam1 (rpmv);
+  CAMLlocal5 (rv, hdrsv, filesv, v, rpmtv);
+  CAMLlocal3 (consv, namesv, reqsv);
+  struct librpm_data data;
+  rpmdbMatchIterator iter;
+  Header h;
+  rpmtd td;
+  const char *str;
+  char **file_reqs = NULL;
+  size_t nr_file_reqs = 0, i, j;
+  int k, n;
+
+  data = Librpm_val (rpmv);
+  if (data.ts == NULL)
+    librpm_handle_closed ();
+
+  td = rpmtdNew ();
+
+  /* Scan all the installed packages. */
+  hdrsv = Val_int (0);
+  iter = rpmtsInitIterator (data.ts, RPMDBI_PACKAGES, NULL, 0);
+  if (iter == NULL)
+    caml_failwith ("rpm_index: rpmtsInitIterator failed");
+
+  while ((h = rpmdbNextIterator (iter)) != NULL) {
+    str = headerGetString (h, RPMTAG_NAME);
+    if (str == NULL)
+      continue;
+    rpmtv = caml_alloc (5, 0);
+    Store_field (rpmtv, 0, caml_copy_string (str));
+    Store_field (rpmtv, 1, Val_int ((int) headerGetNumber (h, RPMTAG_EPOCH)));
+    str = headerGetString (h, RPMTAG_VERSION);
+    Store_field (rpmtv, 2, caml_copy_string (str ? str : "0"));
+    str = headerGetString (h, RPMTAG_RELEASE);
+    Store_field (rpmtv, 3, caml_copy_string (str ? str : "unknown"));
+    str = headerGetString (h, RPMTAG_ARCH);
+    Store_field (rpmtv, 4, caml_copy_string (str ? str : "unknown"));
+
+    reqsv = copy_string_array_tag (h, RPMTAG_REQUIRENAME, td);
+
+    /* Remember the file requirements to look up below. */
+    n = Wosize_val (reqsv);
+    for (k = 0; k < n; ++k) {
+      str = String_val (Field (reqsv, k));
+      if (str[0] == '/') {
+        char **p = realloc (file_reqs, (nr_file_reqs+1) * sizeof (char *));
+        if (p == NULL) {
+          rpmdbFreeIterator (iter);
+          goto oom;
+        }
+        file_reqs = p;
+        file_reqs[nr_file_reqs] = strdup (str);
+        if (file_reqs[nr_file_reqs] == NULL) {
+          rpmdbFreeIterator (iter);
+          goto oom;
+        }
+        nr_file_reqs++;
+      }
+    }
+
+    v = caml_alloc (3, 0);
+    Store_field (v, 0, rpmtv);
+    Store_field (v, 1, reqsv);
+    Store_field (v, 2, copy_string_array_tag (h, RPMTAG_PROVIDENAME, td));
+
+    consv = caml_alloc (2, 0);
+    Store_field (consv, 0, v);
+    Store_field (consv, 1, hdrsv);
+    hdrsv = consv;
+  }
+  rpmdbFreeIterator (iter);
+
+  /* Look up the owners of the required files, once for each file. */
+  qsort (file_reqs, nr_file_reqs, sizeof (char *), compare_strings);
+  filesv = Val_int (0);
+  for (i = 0; i < nr_file_reqs; i = j) {
+    for (j = i+1; j < nr_file_reqs; ++j)
+      if (strcmp (file_reqs[i], file_reqs[j]) != 0)
+        break;
+
+    iter = rpmtsInitIterator (data.ts, RPMDBI_INSTFILENAMES, file_reqs[i], 0);
+    if (iter == NULL)
+      continue;
+
+    namesv = Val_int (0);
+    while ((h = rpmdbNextIterator (iter)) != NULL) {
+      str = headerGetString (h, RPMTAG_NAME);
+      if (str == NULL)
+        continue;
+      v = caml_copy_string (str);
+      consv = caml_alloc (2, 0);
+      Store_field (consv, 0, v);
+      Store_field (consv, 1, namesv);
+      namesv = consv;
+    }
+    rpmdbFreeIterator (iter);
+
+    v = caml_alloc (2, 0);
+    Store_field (v, 0, caml_copy_string (file_reqs[i]));
+    Store_field (v, 1, namesv);
+
+    consv = caml_alloc (2, 0);
+    Store_field (consv, 0, v);
+    Store_field (consv, 1, filesv);
+    filesv = consv;
+  }
+
+  for (i = 0; i < nr_file_reqs; ++i)
+    free (file_reqs[i]);
+  free (file_reqs);
+  rpmtdFree (td);
+
+  if (data.debug >= 2) {
+    printf ("supermin: rpm: index: %zu file requirements\n", nr_file_reqs);
+    fflush (stdout);
+  }
+
+  rv = caml_alloc (2, 0);
+  Store_field (rv, 0, hdrsv);
+  Store_field (rv, 1, filesv);
+  CAMLreturn (rv);
+
+ oom:
+  for (i = 0; i < nr_file_reqs; ++i)
+    free (file_reqs[i]);
+  free (file_reqs);
+  rpmtdFree (td);
+  caml_raise_out_of_memory ();
+}
+
 #else
 
 value
@@ -531,4 +703,10 @@ supermin_rpm_pkg_filelist (value rpmv, value pkgv)
   abort ();
 }
 
+value
+supermin_rpm_index (value rpmv)
+{
+  abort ();
+}
+
 #endif
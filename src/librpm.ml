@@ -49,5 +49,13 @@ external rpm_pkg_requires : t -> string -> string array = "supermin_rpm_pkg_requ
 external rpm_pkg_whatprovides : t -> string -> string array = "supermin_rpm_pkg_whatprovides"
 external rpm_pkg_filelist : t -> string -> rpmfile_t array = "supermin_rpm_pkg_filelist"
 
+type rpmhdr_t = {
+  hdr_rpm : rpm_t;
+  hdr_requires : string array;
+  hdr_provides : string array;
+}
+
+external rpm_index : t -> rpmhdr_t list * (string * string list) list = "supermin_rpm_index"
+
 let () =
   Callback.register_exception "librpm_multiple_matches" (Multiple_matches ("", 0))
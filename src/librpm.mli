@@ -71,3 +71,14 @@ val rpm_pkg_whatprovides : t -> string -> string array
 val rpm_pkg_filelist : t -> string -> rpmfile_t array
 (** Return the list of files contained in a package, and attributes of
     those files (similar to [rpm -ql]). *)
+
+type rpmhdr_t = {
+  hdr_rpm : rpm_t;
+  hdr_requires : string array;
+  hdr_provides : string array;
+}
+
+val rpm_index : t -> rpmhdr_t list * (string * string list) list
+(** Return all the installed packages with their requires and
+    provides, and the names of the packages owning each file which
+    is required by any package, reading the database only once. *)
@@ -65,11 +65,13 @@ and string_of_file_content = function
 let kernel_filename = "kernel"
 and appliance_filename = "root"
 and initrd_filename = "initrd"
+and manifest_filename = "manifest"
 
 let rec build debug
     (copy_kernel, format, host_cpu,
      packager_config, tmpdir, use_installed, size,
-     include_packagelist)
+     include_packagelist, dedup, jobs, layout_trace, incremental,
+     chroot_link, compressed_modules, cache_dir)
     inputs outputdir =
   if debug >= 1 then
     printf "supermin: build: %s\n%!" (String.concat " " inputs);
@@ -86,7 +88,7 @@ let rec build debug
     match format with
     | Chroot ->
       outputdir
-    | Ext2 ->
+    | Ext2 | Ext4 ->
       let basedir = tmpdir // "base.d" in
       mkdir basedir 0o755;
       basedir in
@@ -98,45 +100,75 @@ let rec build debug
     printf "supermin: reading the supermin appliance\n%!";
   let appliance = read_appliance debug basedir empty_appliance inputs in
 
-  (* Resolve dependencies in the list of packages. *)
-  let ph = get_package_handler () in
-  if debug >= 1 then
-    printf "supermin: mapping package names to installed packages\n%!";
-  let packages = filter_map ph.ph_package_of_string appliance.packages in
-  if debug >= 1 then
-    printf "supermin: resolving full list of package dependencies\n%!";
-  let packages =
-    let packages = package_set_of_list packages in
-    get_all_requires packages in
-
-  (* Get the list of packages only if we need to, i.e. when creating
-   * /packagelist in the appliance, when printing all the packages
-   * for debug, or in both cases.
+  (* Resolving the packages and listing their files is slow, but
+   * only depends on the package database and the list of packages,
+   * so with --cache-dir the result is saved and reused while the
+   * package database does not change.
    *)
-  let pretty_packages =
-    if include_packagelist || debug >= 2 then (
-      let pkg_names = PackageSet.elements packages in
-      let pkg_names = List.map ph.ph_package_to_string pkg_names in
-      List.sort compare pkg_names
-    ) else [] in
-
-  if debug >= 1 then (
-    printf "supermin: build: %d packages, including dependencies\n%!"
-      (PackageSet.cardinal packages);
-    if debug >= 2 then (
-      List.iter (printf "  - %s\n") pretty_packages;
-      flush stdlib_stdout
-    )
-  );
+  let ph = get_package_handler () in
+  let cached =
+    match cache_dir with
+    | None -> None
+    | Some dir ->
+      Some (dir // ("packages-" ^ package_cache_key ph appliance.packages)) in
+  let cache =
+    match cached with
+    | None -> None
+    | Some cached -> read_package_cache debug cached in
+
+  let pretty_packages, files =
+    match cache with
+    | Some (pretty_packages, files) ->
+      if debug >= 1 then
+        printf "supermin: build: %d packages from cache\n%!"
+          (List.length pretty_packages);
+      pretty_packages, files
+    | None ->
+      (* Resolve dependencies in the list of packages. *)
+      if debug >= 1 then
+        printf "supermin: mapping package names to installed packages\n%!";
+      let packages = filter_map ph.ph_package_of_string appliance.packages in
+      if debug >= 1 then
+        printf "supermin: resolving full list of package dependencies\n%!";
+      let packages =
+        let packages = package_set_of_list packages in
+        get_all_requires packages in
+
+      (* Get the list of packages only if we need to, i.e. when creating
+       * /packagelist in the appliance, when printing all the packages
+       * for debug, when saving them in the cache, or in all cases.
+       *)
+      let pretty_packages =
+        if include_packagelist || debug >= 2 || cached <> None then (
+          let pkg_names = PackageSet.elements packages in
+          let pkg_names = List.map ph.ph_package_to_string pkg_names in
+          List.sort compare pkg_names
+        ) else [] in
+
+      if debug >= 1 then (
+        printf "supermin: build: %d packages, including dependencies\n%!"
+          (PackageSet.cardinal packages);
+        if debug >= 2 then (
+          List.iter (printf "  - %s\n") pretty_packages;
+          flush stdlib_stdout
+        )
+      );
+
+      (* List the files in each package.  We only want to copy non-config
+       * files to the full appliance, since config files are included in
+       * the base image that we saved when preparing the supermin
+       * appliance.
+       *)
+      let files = get_all_files packages in
+      let files =
+        List.filter (fun file -> not file.ft_config) files in
 
-  (* List the files in each package.  We only want to copy non-config
-   * files to the full appliance, since config files are included in
-   * the base image that we saved when preparing the supermin
-   * appliance.
-   *)
-  let files = get_all_files packages in
-  let files =
-    List.filter (fun file -> not file.ft_config) files in
+      (match cached with
+       | None -> ()
+       | Some cached ->
+         write_package_cache debug cached (pretty_packages, files)
+      );
+      pretty_packages, files in
 
   if debug >= 1 then
     printf "supermin: build: %d files\n%!" (List.length files);
@@ -227,19 +259,103 @@ let rec build debug
   (match format with
   | Chroot ->
     (* chroot doesn't need an external kernel or initrd *)
-    Format_chroot.build_chroot debug files outputdir packagelist_file
+    Format_chroot.build_chroot debug files outputdir packagelist_file jobs
+                               chroot_link
 
-  | Ext2 ->
+  | Ext2 | Ext4 ->
     let kernel = outputdir // kernel_filename
     and appliance = outputdir // appliance_filename
     and initrd = outputdir // initrd_filename in
     let kernel_version, modpath =
       Format_ext2_kernel.build_kernel debug host_cpu copy_kernel kernel in
+    let manifest = outputdir // manifest_filename in
+    (* Everything apart from the list of files which determines the
+     * content of the appliance.
+     *)
+    let key =
+      let modules_dep =
+        try sprintf "%.9f" (stat (modpath // "modules.dep")).st_mtime
+        with Unix_error _ -> "" in
+      let size =
+        match size with
+        | None -> ""
+        | Some (Size size) -> Int64.to_string size
+        | Some (Auto_size headroom) -> sprintf "auto+%d%%" headroom in
+      let key = [ Config.package_version;
+                  if format = Ext4 then "ext4" else "ext2";
+                  string_of_bool dedup; size;
+                  string_of_bool include_packagelist;
+                  kernel_version; modules_dep ] @ inputs_stamp inputs in
+      Digest.to_hex (Digest.string (String.concat "\n" key)) in
+    let previous =
+      match incremental with
+      | None -> None
+      | Some old_outputdir ->
+        let old_appliance = old_outputdir // appliance_filename
+        and old_manifest = old_outputdir // manifest_filename in
+        if Sys.file_exists old_appliance && Sys.file_exists old_manifest
+        then Some (old_appliance, old_manifest)
+        else None in
     Format_ext2.build_ext2 debug basedir files modpath kernel_version
-                           appliance size packagelist_file;
-    Format_ext2_initrd.build_initrd debug tmpdir modpath initrd
+                           appliance size packagelist_file dedup jobs
+                           (format = Ext4) layout_trace manifest key previous;
+    Format_ext2_initrd.build_initrd debug tmpdir modpath kernel_version
+                                    initrd compressed_modules cache_dir
   )
 
+(* The cache key covers everything which affects the packages and
+ * files: the package handler, the package database and the list of
+ * packages in the supermin appliance.
+ *)
+and package_cache_key ph packages =
+  let key = [ Config.package_version; get_package_handler_name ();
+              sprintf "%.9f" (ph.ph_get_package_database_mtime ());
+              String.concat " " (List.sort compare packages) ] in
+  Digest.to_hex (Digest.string (String.concat "\n" key))
+
+and read_package_cache debug cached =
+  if not (Sys.file_exists cached) then None
+  else (
+    if debug >= 1 then
+      printf "supermin: build: reading cached package list '%s'\n%!" cached;
+    (* An unreadable or corrupt cache file is just a miss. *)
+    try
+      let chan = open_in_bin cached in
+      let r =
+        try Some (Marshal.from_channel chan : string list * file list)
+        with End_of_file | Failure _ | Sys_error _ -> None in
+      close_in chan;
+      r
+    with Sys_error msg ->
+      if debug >= 1 then
+        printf "supermin: build: could not read cached package list: %s\n%!"
+          msg;
+      None
+  )
+
+and write_package_cache debug cached data =
+  (* Failing to update the cache is not fatal.  Other instances of
+   * supermin may be filling the cache at the same time, so write the
+   * file under a temporary name and rename it.
+   *)
+  try
+    (try mkdir (Filename.dirname cached) 0o755
+     with Unix_error (EEXIST, _, _) -> ());
+    let tmpfile = cached ^ "." ^ string_random8 () in
+    let chan = open_out_bin tmpfile in
+    Marshal.to_channel chan data [];
+    close_out chan;
+    rename tmpfile cached;
+    if debug >= 1 then
+      printf "supermin: build: saved package list in cache '%s'\n%!" cached
+  with
+  | Unix_error (err, fn, _) ->
+    eprintf "supermin: warning: could not save package list in cache: %s: %s\n%!"
+            fn (error_message err)
+  | Sys_error msg ->
+    eprintf "supermin: warning: could not save package list in cache: %s\n%!"
+            msg
+
 and read_appliance debug basedir appliance = function
   | [] -> appliance
 
@@ -291,6 +407,23 @@ and read_appliance debug basedir appliance = function
 
     read_appliance debug basedir appliance rest
 
+(* The names, sizes and modification times of all the input files,
+ * which includes the base image.
+ *)
+and inputs_stamp = function
+  | [] -> []
+
+  | dir :: rest when Sys.is_directory dir ->
+    let inputs = Array.to_list (Sys.readdir dir) in
+    let inputs = List.sort compare inputs in
+    let inputs = List.map ((//) dir) inputs in
+    inputs_stamp (inputs @ rest)
+
+  | file :: rest ->
+    let st = stat file in
+    sprintf "%s %d %Ld %.9f" file st.st_ino st.st_size st.st_mtime
+    :: inputs_stamp rest
+
 and update_appliance appliance lines = function
   | Packages ->
     { appliance with packages = appliance.packages @ lines }
@@ -469,11 +602,12 @@ and munge files =
 and get_outputs
     (copy_kernel, format, host_cpu,
      packager_config, tmpdir, use_installed, size,
-     include_packagelist)
+     include_packagelist, dedup, jobs, layout_trace, incremental,
+     chroot_link, compressed_modules, cache_dir)
     inputs =
   match format with
   | Chroot ->
     (* The content for chroot depends on the packages. *)
     []
-  | Ext2 ->
+  | Ext2 | Ext4 ->
     [kernel_filename; appliance_filename; initrd_filename]
@@ -18,10 +18,10 @@
 
 (** Implements the [--build] subcommand. *)
 
-val build : int -> (bool * Types.format * string * string option * string * bool * int64 option * bool) -> string list -> string -> unit
+val build : int -> (bool * Types.format * string * string option * string * bool * Types.size option * bool * bool * int * string option * string option * bool * bool * string option) -> string list -> string -> unit
 (** [build debug (args...) inputs outputdir] performs the
     [supermin --build] subcommand. *)
 
-val get_outputs : (bool * Types.format * string * string option * string * bool * int64 option * bool) -> string list -> string list
+val get_outputs : (bool * Types.format * string * string option * string * bool * Types.size option * bool * bool * int * string option * string option * bool * bool * string option) -> string list -> string list
 (** [get_outputs (args...) inputs] gets the potential outputs for the
     appliance. *)
@@ -23,7 +23,8 @@ open Utils
 
 let prepare debug (copy_kernel, format, host_cpu,
              packager_config, tmpdir, use_installed, size,
-             include_packagelist)
+             include_packagelist, dedup, jobs, layout_trace, incremental,
+             chroot_link, compressed_modules, cache_dir)
     inputs outputdir =
   if debug >= 1 then
     printf "supermin: prepare: %s\n%!" (String.concat " " inputs);
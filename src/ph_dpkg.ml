@@ -23,11 +23,14 @@ open Printf
 open Utils
 open Package_handler
 
+module StringSet = Set.Make (String)
+
+let stringset_of_list strs =
+  List.fold_left (fun set elem -> StringSet.add elem set) StringSet.empty strs
+
 let dpkg_detect () =
   Config.dpkg <> "no" &&
     Config.dpkg_deb <> "no" &&
-    Config.dpkg_query <> "no" &&
-    Config.dpkg_divert <> "no" &&
     Config.apt_get <> "no" &&
     (List.mem (Os_release.get_id ()) [ "debian"; "ubuntu" ] ||
      try (stat "/etc/debian_version").st_kind = S_REG with Unix_error _ -> false)
@@ -53,30 +56,111 @@ type dpkg_t = {
 (* Memo from package type to internal dpkg_t. *)
 let dpkg_of_pkg, pkg_of_dpkg = get_memo_functions ()
 
-let dpkg_packages = Hashtbl.create 13
-let dpkg_package_of_string str =
-  if Hashtbl.length dpkg_packages == 0 then (
-    let cmd =
-      sprintf "%s --show --showformat='${Package} ${Version} ${Architecture} ${Status}\\n'"
-        Config.dpkg_query in
-    let lines = run_command_get_lines cmd in
+(* The dpkg database is read directly instead of using dpkg-query
+ * and dpkg-divert, since running them several times is slow.
+ *)
+let dpkg_admindir = "/var/lib/dpkg"
+
+(* Read a file of RFC 822-style stanzas like the dpkg status file,
+ * returning only the fields in [keys].  Continuation lines are joined
+ * to the value of the field with a space.
+ *)
+let read_control_file filename keys =
+  let chan = open_in filename in
+  let lines = input_all_lines chan in
+  close_in chan;
+  let stanzas = ref [] and fields = ref [] and wanted = ref false in
+  let end_stanza () =
+    if !fields <> [] then stanzas := !fields :: !stanzas;
+    fields := [] in
+  List.iter (
+    fun line ->
+      if line = "" then end_stanza ()
+      else if line.[0] = ' ' || line.[0] = '\t' then (
+        match !fields with
+        | (key, v) :: rest when !wanted ->
+          fields := (key, v ^ " " ^ String.trim line) :: rest
+        | _ -> ()
+      )
+      else (
+        try
+          let i = String.index line ':' in
+          let key = String.sub line 0 i in
+          wanted := List.mem key keys;
+          if !wanted then (
+            let v = String.sub line (i+1) (String.length line - i - 1) in
+            fields := (key, String.trim v) :: !fields
+          )
+        with Not_found -> wanted := false
+      )
+  ) lines;
+  end_stanza ();
+  List.rev !stanzas
+
+(* Parse a Depends or Pre-Depends field into a list of dependencies,
+ * each of which is a list of alternative package names.  Version
+ * constraints and architecture qualifiers are removed.
+ *)
+let parse_depends str =
+  let name alt =
+    let alt = String.trim alt in
+    let len = String.length alt in
+    let rec loop i =
+      if i >= len then i
+      else match alt.[i] with
+           | ' ' | '\t' | '(' | '[' | '<' | ':' -> i
+           | _ -> loop (i+1) in
+    String.sub alt 0 (loop 0) in
+  let deps = string_split "," str in
+  let deps = List.map (
+    fun dep -> List.filter ((<>) "") (List.map name (string_split "|" dep))
+  ) deps in
+  List.filter ((<>) []) deps
+
+type dpkg_status = {
+  dpkg : dpkg_t;
+  depends : string list list;           (* Depends and Pre-Depends *)
+}
+
+(* Installed packages from the status file, name -> dpkg_status. *)
+let dpkg_status = Hashtbl.create 13
+let get_dpkg_status () =
+  if Hashtbl.length dpkg_status = 0 then (
+    let stanzas =
+      read_control_file (dpkg_admindir // "status")
+        [ "Package"; "Version"; "Architecture"; "Status";
+          "Depends"; "Pre-Depends" ] in
     List.iter (
-      fun line ->
-        match string_split " " line with
-        | [ name; version; arch; _; _; "installed" ] ->
-          let dpkg = { name = name; version = version; arch = arch } in
-          Hashtbl.add dpkg_packages name dpkg
-        | _ -> ();
-    ) lines
+      fun fields ->
+        let field key = try List.assoc key fields with Not_found -> "" in
+        let installed =
+          match string_split " " (field "Status") with
+          | [ _; _; "installed" ] -> true
+          | _ -> false in
+        if installed then (
+          let dpkg = { name = field "Package"; version = field "Version";
+                       arch = field "Architecture" } in
+          let depends =
+            parse_depends (field "Pre-Depends") @
+              parse_depends (field "Depends") in
+          Hashtbl.add dpkg_status dpkg.name { dpkg = dpkg; depends = depends }
+        )
+    ) stanzas;
+    if !settings.debug >= 1 then
+      printf "supermin: dpkg: read %d installed packages from %s\n%!"
+        (Hashtbl.length dpkg_status) (dpkg_admindir // "status")
   );
-  let candidates = Hashtbl.find_all dpkg_packages str in
+  dpkg_status
+
+let dpkg_package_of_string str =
+  let candidates = Hashtbl.find_all (get_dpkg_status ()) str in
   (* On multiarch setups, only consider the primary architecture *)
   try
     let pkg = List.find (
-      fun cand ->
+      fun { dpkg = cand } ->
         cand.arch = !dpkg_primary_arch || cand.arch = "all"
     ) candidates in
-    Some (pkg_of_dpkg pkg)
+    Some (pkg_of_dpkg pkg.dpkg)
   with
     Not_found -> None
 
@@ -88,70 +172,98 @@ let dpkg_package_name pkg =
   let dpkg = dpkg_of_pkg pkg in
   dpkg.name
 
-let dpkg_package_name_arch pkg =
-  let dpkg = dpkg_of_pkg pkg in
-  sprintf "%s:%s" dpkg.name dpkg.arch
-
 let dpkg_get_package_database_mtime () =
-  (lstat "/var/lib/dpkg/status").st_mtime
+  (lstat (dpkg_admindir // "status")).st_mtime
 
 let dpkg_get_all_requires pkgs =
-  let dpkg_requires = Hashtbl.create 13 in
-  (* Prepare dpkg_requires hashtbl with depends, pre-depends from all
-     packages. Strip version information and discard alternative
-     dependencies *)
-  let cmd = sprintf "\
-      %s --show --showformat='${Package} ${Depends} ${Pre-Depends}\n' | \
-      sed -e 's/ *([^)]*) */ /g' \
-          -e 's/ *, */ /g' \
-          -e 's/ *| *[^ ]* */ /g'"
-    Config.dpkg_query in
-  let lines = run_command_get_lines cmd in
-  List.iter (
-    fun line ->
-      match string_split " " line with
-      | [] -> ()
-      | pkgname :: [] -> ()
-      | pkgname :: deps -> Hashtbl.add dpkg_requires pkgname deps
-  ) lines;
-
-  let get pkgs =
-    let pkgnames = List.map dpkg_package_name (PackageSet.elements pkgs) in
-    let deps = List.map (Hashtbl.find_all dpkg_requires) pkgnames in
-    let deps = List.flatten (List.flatten deps) in
-    let deps = filter_map dpkg_package_of_string deps in
-    PackageSet.union pkgs (package_set_of_list deps)
-  in
-  (* The command above only gets one level of dependencies.  We need
-   * to keep iterating until we reach a fixpoint.
+  let status = get_dpkg_status () in
+  (* For a dependency with alternatives ('a | b'), nothing needs to be
+   * added if one of them is already in the closure.  Otherwise pick
+   * the first alternative which is installed.
+   *)
+  let resolve names dep =
+    if List.exists (fun name -> StringSet.mem name names) dep then None
+    else (
+      let rec loop = function
+        | [] -> None
+        | name :: rest ->
+          match dpkg_package_of_string name with
+          | Some pkg -> Some pkg
+          | None -> loop rest in
+      loop dep
+    ) in
+  (* Each package is taken off the queue once, and its dependencies
+   * not already in the closure are added to it and to the queue.
    *)
-  let rec loop pkgs =
-    let pkgs' = get pkgs in
-    if PackageSet.equal pkgs pkgs' then pkgs
-    else loop pkgs'
-  in
-  loop pkgs
+  let queue = Queue.create () in
+  let final = ref pkgs in
+  let names =
+    ref (stringset_of_list (List.map dpkg_package_name
+                                     (PackageSet.elements pkgs))) in
+  PackageSet.iter (fun pkg -> Queue.push pkg queue) pkgs;
+  while not (Queue.is_empty queue) do
+    let pkg = Queue.pop queue in
+    let dpkg = dpkg_of_pkg pkg in
+    let depends =
+      try (List.find (fun st -> st.dpkg = dpkg)
+                     (Hashtbl.find_all status dpkg.name)).depends
+      with Not_found -> [] in
+    List.iter (
+      fun dep ->
+        match resolve !names dep with
+        | None -> ()
+        | Some pkg ->
+          if not (PackageSet.mem pkg !final) then (
+            final := PackageSet.add pkg !final;
+            names := StringSet.add (dpkg_package_name pkg) !names;
+            Queue.push pkg queue
+          )
+    ) depends
+  done;
+  !final
 
+(* The diversions file contains groups of three lines: the diverted
+ * path, the path it is diverted to, and the package which did it
+ * (":" for local diversions, which are ignored like dpkg-divert
+ * --list did).
+ *)
 let dpkg_diversions = Hashtbl.create 13
+let read_diversions () =
+  let filename = dpkg_admindir // "diversions" in
+  if Sys.file_exists filename then (
+    let chan = open_in filename in
+    let lines = input_all_lines chan in
+    close_in chan;
+    let rec loop = function
+      | path :: real_path :: pkg :: rest ->
+        if pkg <> ":" then Hashtbl.add dpkg_diversions path real_path;
+        loop rest
+      | _ -> () in
+    loop lines
+  )
+
+(* Packages which are Multi-Arch: same have their file list in
+ * info/NAME:ARCH.list, others in info/NAME.list.
+ *)
+let dpkg_package_files pkg =
+  let dpkg = dpkg_of_pkg pkg in
+  let info = dpkg_admindir // "info" in
+  let lists = [ info // sprintf "%s:%s.list" dpkg.name dpkg.arch;
+                info // sprintf "%s.list" dpkg.name ] in
+  match List.filter Sys.file_exists lists with
+  | [] -> []
+  | list :: _ ->
+    let chan = open_in list in
+    let lines = input_all_lines chan in
+    close_in chan;
+    List.filter (fun path -> string_prefix "/" path && path <> "/.") lines
+
 let dpkg_get_all_files pkgs =
-  if Hashtbl.length dpkg_diversions = 0 then (
-    let cmd = sprintf "%s --list" Config.dpkg_divert in
-    let lines = run_command_get_lines cmd in
-    List.iter (
-      fun line ->
-        let items = string_split " " line in
-        match items with
-        | ["diversion"; "of"; path; "to"; real_path; "by"; pkg] ->
-          Hashtbl.add dpkg_diversions path real_path
-        | _ -> ()
-    ) lines
-  );
-  let cmd =
-    sprintf "%s --listfiles %s | grep '^/' | grep -v '^/.$' | sort -u"
-      Config.dpkg_query
-      (quoted_list (List.map dpkg_package_name_arch
-		      (PackageSet.elements pkgs))) in
-  let lines = run_command_get_lines cmd in
+  if Hashtbl.length dpkg_diversions = 0 then
+    read_diversions ();
+  let paths =
+    List.map dpkg_package_files (PackageSet.elements pkgs) in
+  let paths = sort_uniq (List.flatten paths) in
   List.map (
     fun path ->
       let config =
@@ -161,7 +273,7 @@ let dpkg_get_all_files pkgs =
         try Hashtbl.find dpkg_diversions path
         with Not_found -> path in
       { ft_path = path; ft_source_path = source_path; ft_config = config }
-  ) lines
+  ) paths
 
 let dpkg_download_all_packages pkgs dir =
   let tdir = !settings.tmpdir // string_random8 () in
@@ -45,76 +45,120 @@ type pac_t = {
 (* Memo from package type to internal pac_t. *)
 let pac_of_pkg, pkg_of_pac = get_memo_functions ()
 
-(* Memo of pacman_package_of_string. *)
-let pach = Hashtbl.create 13
+(* The local pacman database is read directly instead of running
+ * pacman and pactree for each package, which is slow.  Each
+ * installed package has a directory local/NAME-VERSION containing
+ * the files 'desc' and 'files'.
+ *)
+let pacman_dbpath = "/var/lib/pacman"
 
-let pacman_package_of_string str =
-  (* Parse a package name into the fields like name and version. *)
-  let parse_pac str =
-    let cmd = sprintf "%s -Qi %s" Config.pacman (quote str) in
-    if !settings.debug >= 2 then printf "%s" cmd;
-    let lines = run_command_get_lines cmd in
+type local_pac = {
+  pac : pac_t;
+  pac_dir : string;                     (* directory in the local db *)
+  depends : string list;
+  provides : string list;
+}
 
-    let name = ref "" and evr = ref "" and arch = ref "" in
-    List.iter (
-      fun line ->
-        let get_value r =
-          let len = String.length line in
-          let i = String.index line ':' in
-          r := String.sub line (i+2) (len-(i+2))
-        in
-        if string_prefix "Name " line then get_value name
-        else if string_prefix "Version " line then get_value evr
-        else if string_prefix "Architecture " line then get_value arch
-    ) lines;
-
-    let name = !name and evr = !evr and arch = !arch in
-    if name = "" || evr = "" || arch = "" then
-      error "pacman: Name/Version/Architecture field missing in output of %s" cmd;
-
-    (* Parse epoch:version-release field. *)
-    let epoch, version, release =
-      try
-        let epoch, vr =
-          try
-            let i = String.index evr ':' in
-            int_of_string (String.sub evr 0 i),
-            String.sub evr (i+1) (String.length evr - (i+1))
-          with Not_found -> 0, evr in
-        let version, release =
-          match string_split "-" vr with
-          | [ v; r ] -> v, r
-          | _ -> assert false in
-        epoch, version, release
-      with
-        Failure _ ->
-          error "failed to parse epoch:version-release field: %s " evr in
-
-    { name = name;
-      epoch = epoch;
-      version = version;
-      release = release;
-      arch = arch }
-
-  (* Check if a package is installed. *)
-  and check_pac_installed name =
-    let cmd = sprintf "%s -Qq %s >/dev/null 2>&1" Config.pacman (quote name) in
-    if !settings.debug >= 2 then printf "%s" cmd;
-    0 = Sys.command cmd
+(* Read a local database file, which contains sections starting
+ * with a %KEY% line, followed by one value per line, and ending
+ * with a blank line.
+ *)
+let read_db_file filename =
+  let chan = open_in filename in
+  let lines = input_all_lines chan in
+  close_in chan;
+  let rec values vs = function
+    | [] -> List.rev vs, []
+    | "" :: rest -> List.rev vs, rest
+    | v :: rest -> values (v :: vs) rest
   in
+  let rec loop acc = function
+    | [] -> acc
+    | line :: rest ->
+      let len = String.length line in
+      if len >= 2 && line.[0] = '%' && line.[len-1] = '%' then (
+        let key = String.sub line 1 (len-2) in
+        let vs, rest = values [] rest in
+        loop ((key, vs) :: acc) rest
+      )
+      else loop acc rest
+  in
+  loop [] lines
+
+(* Remove the version constraint from a dependency or provide,
+ * eg. "readline>=7.0" or "sh=5.2".
+ *)
+let dep_name str =
+  let len = String.length str in
+  let rec loop i =
+    if i >= len then str
+    else match str.[i] with
+         | '<' | '>' | '=' -> String.sub str 0 i
+         | _ -> loop (i+1) in
+  loop 0
 
+(* Parse epoch:version-release field. *)
+let parse_evr evr =
   try
-    Hashtbl.find pach str
+    let epoch, vr =
+      try
+        let i = String.index evr ':' in
+        int_of_string (String.sub evr 0 i),
+        String.sub evr (i+1) (String.length evr - (i+1))
+      with Not_found -> 0, evr in
+    let version, release =
+      match string_split "-" vr with
+      | [ v; r ] -> v, r
+      | _ -> assert false in
+    epoch, version, release
   with
-    Not_found ->
-      let r =
-        if check_pac_installed str then (
-          let pac = parse_pac str in
-          Some (pkg_of_pac pac)
+    Failure _ ->
+      error "failed to parse epoch:version-release field: %s " evr
+
+(* Installed packages, name -> local_pac, and provides, provided
+ * name -> names of the packages providing it.
+ *)
+let local_names = Hashtbl.create 13
+let local_provides = Hashtbl.create 13
+
+let get_local_db () =
+  if Hashtbl.length local_names = 0 then (
+    let localdir = pacman_dbpath // "local" in
+    let dirs = Array.to_list (Sys.readdir localdir) in
+    let dirs = List.map ((//) localdir) dirs in
+    let dirs = List.filter Sys.is_directory dirs in
+    List.iter (
+      fun dir ->
+        let desc = dir // "desc" in
+        if Sys.file_exists desc then (
+          let fields = read_db_file desc in
+          let field key = try List.assoc key fields with Not_found -> [] in
+          match field "NAME", field "VERSION", field "ARCH" with
+          | [ name ], [ evr ], [ arch ] ->
+            let epoch, version, release = parse_evr evr in
+            let pac = { name = name; epoch = epoch; version = version;
+                        release = release; arch = arch } in
+            let provides = List.map dep_name (field "PROVIDES") in
+            Hashtbl.add local_names name
+              { pac = pac; pac_dir = dir;
+                depends = List.map dep_name (field "DEPENDS");
+                provides = provides };
+            List.iter (
+              fun prov -> Hashtbl.add local_provides prov name
+            ) provides
+          | _ ->
+            error "pacman: NAME/VERSION/ARCH field missing in %s" desc
         )
-        else None in
-      Hashtbl.add pach str r;
-      r
+    ) dirs;
+    if !settings.debug >= 1 then
+      printf "supermin: pacman: read %d installed packages from %s\n%!"
+        (Hashtbl.length local_names) localdir
+  );
+  local_names
+
+let pacman_package_of_string str =
+  try Some (pkg_of_pac (Hashtbl.find (get_local_db ()) str).pac)
+  with Not_found -> None
 
 let pacman_package_to_string pkg =
   let pac = pac_of_pkg pkg in
@@ -129,31 +173,65 @@ let pacman_package_name pkg =
   pac.name
 
 let pacman_get_package_database_mtime () =
-  (* This directory changes mtime when packages get installed/reinstalled.
-   * The directory itself contains several *.db files with different names.
+  (* The local database has a directory per installed package, so
+   * this changes mtime whenever packages are installed, upgraded or
+   * removed.  (The sync databases only change when they are refreshed
+   * from the mirrors.)
    *)
-  (lstat "/var/lib/pacman/sync/").st_mtime
+  (lstat "/var/lib/pacman/local/").st_mtime
+
+(* Return the installed package satisfying a dependency: the package
+ * with that name, else (like pactree) one which provides it.
+ *)
+let satisfier names dep =
+  try Some (Hashtbl.find names dep)
+  with Not_found ->
+    match List.sort compare (Hashtbl.find_all local_provides dep) with
+    | [] -> None
+    | name :: _ ->
+      try Some (Hashtbl.find names name) with Not_found -> None
 
 let pacman_get_all_requires pkgs =
-  let cmd = sprintf "\
-    for p in %s; do %s -u $p; done | awk '{print $1}' | sort -u
-  " (quoted_list (List.map pacman_package_name (PackageSet.elements pkgs)))
-    Config.pactree in
-  if !settings.debug >= 2 then printf "%s" cmd;
-  let lines = run_command_get_lines cmd in
-  let lines = filter_map pacman_package_of_string lines in
-  PackageSet.union pkgs (package_set_of_list lines)
+  let names = get_local_db () in
+  let queue = Queue.create () in
+  let final = ref pkgs in
+  PackageSet.iter (fun pkg -> Queue.push pkg queue) pkgs;
+  while not (Queue.is_empty queue) do
+    let pkg = Queue.pop queue in
+    let depends =
+      try (Hashtbl.find names (pacman_package_name pkg)).depends
+      with Not_found -> [] in
+    List.iter (
+      fun dep ->
+        match satisfier names dep with
+        | None -> ()
+        | Some { pac = pac } ->
+          let pkg = pkg_of_pac pac in
+          if not (PackageSet.mem pkg !final) then (
+            final := PackageSet.add pkg !final;
+            Queue.push pkg queue
+          )
+    ) depends
+  done;
+  !final
 
 let pacman_get_all_files pkgs =
-  let cmd =
-    sprintf "%s -Ql %s | awk '{print $2}'"
-      Config.pacman
-      (quoted_list (List.map pacman_package_name (PackageSet.elements pkgs))) in
-  if !settings.debug >= 2 then printf "%s" cmd;
-  let lines = run_command_get_lines cmd in
+  let names = get_local_db () in
+  let files =
+    List.map (
+      fun pkg ->
+        try
+          let local = Hashtbl.find names (pacman_package_name pkg) in
+          List.assoc "FILES" (read_db_file (local.pac_dir // "files"))
+        with Not_found | Sys_error _ -> []
+    ) (PackageSet.elements pkgs) in
+  let files = List.flatten files in
   List.map (
     fun path ->
-      (* Remove trailing / from directory names. *)
+      (* Paths are relative to the root, and directory names have a
+       * trailing /, which is removed.
+       *)
+      let path = "/" ^ path in
       let path =
         let len = String.length path in
         if len >= 2 && path.[len-1] = '/' then
@@ -164,7 +242,7 @@ let pacman_get_all_files pkgs =
 	try string_prefix "/etc/" path && (lstat path).st_kind = S_REG
 	with Unix_error _ -> false in
       { ft_path = path; ft_source_path = path; ft_config = config }
-  ) lines
+  ) files
 
 let pacman_download_all_packages pkgs dir =
   let tdir = !settings.tmpdir // string_random8 () in
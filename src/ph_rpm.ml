@@ -167,27 +167,28 @@ let rpm_to_evr_string rpm =
     sprintf "%d:%s-%s"
       rpm.epoch rpm.version rpm.release
 
+(* RPM will return multiple hits when either multiple versions or
+ * multiple arches are installed at the same time.  We are only
+ * interested in the highest version with the best architecture.
+ *)
+let best_rpm rpms =
+  let rpms = List.map (fun rpm -> (rpm, rpm_to_evr_string rpm)) rpms in
+  let cmp (pkg1, evr1) (pkg2, evr2) =
+    let weight_of_arch = function
+      | "noarch" -> 100
+      | a when a = !rpm_arch -> 50
+      | _ -> 0
+    in
+    let i = compare (weight_of_arch pkg2.arch) (weight_of_arch pkg1.arch) in
+    if i <> 0 then i
+    else rpm_vercmp evr2 evr2
+  in
+  let rpms = List.sort cmp rpms in
+  fst (List.hd rpms)
+
 let rpm_package_of_string str =
   let query rpm =
-    let rpms = Array.to_list (rpm_installed (get_rpm ()) rpm) in
-    let rpms = List.map (fun rpm -> (rpm, rpm_to_evr_string rpm)) rpms in
-    (* RPM will return multiple hits when either multiple versions or
-     * multiple arches are installed at the same time.  We are only
-     * interested in the highest version with the best
-     * architecture.
-     *)
-    let cmp (pkg1, evr1) (pkg2, evr2) =
-      let weight_of_arch = function
-        | "noarch" -> 100
-        | a when a = !rpm_arch -> 50
-        | _ -> 0
-      in
-      let i = compare (weight_of_arch pkg2.arch) (weight_of_arch pkg1.arch) in
-      if i <> 0 then i
-      else rpm_vercmp evr2 evr2
-    in
-    let rpms = List.sort cmp rpms in
-    fst (List.hd rpms)
+    best_rpm (Array.to_list (rpm_installed (get_rpm ()) rpm))
   in
 
   try
@@ -255,6 +256,51 @@ let find_rpmdb () =
 let rpm_get_package_database_mtime () =
   (lstat (find_rpmdb ())).st_mtime
 
+(* In-memory index of the installed packages, built with a single
+ * scan of the RPM database the first time it is needed.
+ *)
+type index = {
+  (* Package name -> headers of the installed packages with that name. *)
+  idx_names : (string, rpmhdr_t) Hashtbl.t;
+  (* Provide -> names of the packages providing it. *)
+  idx_provides : (string, string) Hashtbl.t;
+  (* Required file -> names of the packages containing it. *)
+  idx_files : (string, string list) Hashtbl.t;
+}
+
+let get_index =
+  let index = ref None in
+  fun () ->
+    match !index with
+    | Some index -> index
+    | None ->
+      let hdrs, files = rpm_index (get_rpm ()) in
+      let idx_names = Hashtbl.create 1024
+      and idx_provides = Hashtbl.create 16384
+      and idx_files = Hashtbl.create 1024 in
+      List.iter (
+        fun hdr ->
+          Hashtbl.add idx_names hdr.hdr_rpm.name hdr;
+          Array.iter (
+            fun prov -> Hashtbl.add idx_provides prov hdr.hdr_rpm.name
+          ) hdr.hdr_provides
+      ) hdrs;
+      List.iter (fun (path, names) -> Hashtbl.add idx_files path names) files;
+      if !settings.debug >= 1 then
+        printf "supermin: rpm: indexed %d packages\n%!" (List.length hdrs);
+      let i = { idx_names; idx_provides; idx_files } in
+      index := Some i;
+      i
+
+(* Return the header of the best installed package called [name]. *)
+let best_header index name =
+  match Hashtbl.find_all index.idx_names name with
+  | [] -> raise Not_found
+  | [hdr] -> hdr
+  | hdrs ->
+    let rpm = best_rpm (List.map (fun hdr -> hdr.hdr_rpm) hdrs) in
+    List.find (fun hdr -> hdr.hdr_rpm == rpm) hdrs
+
 (* Return the best provider of a particular RPM requirement.
  *
  * There may be multiple, or no providers.  In case there are multiple,
@@ -265,20 +311,23 @@ let rpm_get_package_database_mtime () =
 let provider =
   (* Memo of resolved provides. *)
   let rpm_providers = Hashtbl.create 13 in
-  fun req ->
+  fun index req ->
     try Hashtbl.find rpm_providers req
     with Not_found ->
       let ret =
         try
-          (* 'providers' here is an array of just package names. *)
-          let providers = rpm_pkg_whatprovides (get_rpm ()) req in
-          let providers = Array.to_list providers in
-          (* --whatprovides will return duplicate identical packages, so: *)
-          let providers = sort_uniq providers in
-          (* Only packages which are actually installed: *)
+          (* Like 'rpm --whatprovides', files are looked up in the
+           * file lists first, then in the provides.
+           *)
           let providers =
-            List.filter (fun name -> rpm_package_of_string name <> None)
-                        providers in
+            let files =
+              if req <> "" && req.[0] = '/' then
+                try Hashtbl.find index.idx_files req with Not_found -> []
+              else [] in
+            if files <> [] then files
+            else Hashtbl.find_all index.idx_provides req in
+          (* A package can provide the same thing several times, so: *)
+          let providers = sort_uniq providers in
 
           match providers with
           | [] -> None
@@ -302,19 +351,12 @@ let provider =
       ret
 
 let rpm_get_all_requires pkgs =
+  let index = get_index () in
   let get pkg =
-    let reqs =
-      try
-        rpm_pkg_requires (get_rpm ()) pkg
-      with
-        Multiple_matches _ as ex ->
-          match rpm_package_of_string pkg with
-            | None -> raise ex
-            | Some pkg ->
-              rpm_pkg_requires (get_rpm ()) (rpm_package_to_string pkg) in
+    let reqs = (best_header index pkg).hdr_requires in
     let pkgs' = Array.fold_left (
       fun set x ->
-        match provider x with
+        match provider index x with
         | None -> set
         | Some p -> StringSet.add p set
     ) StringSet.empty reqs in
@@ -340,7 +382,11 @@ let rpm_get_all_requires pkgs =
       resolved := StringSet.add current !resolved
     )
   done;
-  let pkgs' = filter_map rpm_package_of_string (StringSet.elements !final) in
+  let pkgs' = filter_map (
+    fun name ->
+      try Some (pkg_of_rpm (best_header index name).hdr_rpm)
+      with Not_found -> rpm_package_of_string name
+  ) (StringSet.elements !final) in
   package_set_of_list pkgs'
 
 let rpm_get_all_files pkgs =
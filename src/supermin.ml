@@ -97,12 +97,20 @@ let main () =
     let use_installed = ref false in
     let size = ref None in
     let include_packagelist = ref false in
+    let dedup = ref false in
+    let jobs = ref 4 in
+    let layout_trace = ref "" in
+    let incremental = ref false in
+    let chroot_link = ref false in
+    let compressed_modules = ref false in
+    let cache_dir = ref "" in
 
     let set_debug () = incr debug in
 
     let set_format = function
       | "chroot" | "fs" | "filesystem" -> format := Some Chroot
       | "ext2" -> format := Some Ext2
+      | "ext4" -> format := Some Ext4
       | s -> error "unknown --format option (%s)\n" s
     in
 
@@ -118,7 +126,17 @@ let main () =
       error "you must use --prepare or --build to select the mode"
     in
 
-    let set_size arg = size := Some (parse_size arg) in
+    let auto_size_re = Str.regexp "^auto\\(\\+\\([0-9]+\\)%\\)?$" in
+    let set_size arg =
+      if Str.string_match auto_size_re arg 0 then (
+        let headroom =
+          try int_of_string (Str.matched_group 2 arg)
+          with Not_found -> 10 in
+        size := Some (Auto_size headroom)
+      )
+      else
+        size := Some (Size (parse_size arg))
+    in
 
     let error_supermin_5 () =
       error "\
@@ -143,21 +161,31 @@ appliance automatically.
     let ditto = " -\"-" in
     let argspec = Arg.align [
       "--build",   Arg.Unit set_build_mode,   " Build a full appliance";
+      "--cache-dir", Arg.Set_string cache_dir, "DIR Cache build results in DIR";
+      "--chroot-link", Arg.Set chroot_link,   " Hard link host files into chroot";
+      "--compressed-modules", Arg.Set compressed_modules,
+                                              " Keep kernel modules compressed in initrd";
       "--copy-kernel", Arg.Set copy_kernel,   " Copy kernel instead of symlinking";
+      "--dedup",   Arg.Set dedup,             " Share inodes between identical files";
       "--dtb",     Arg.String error_dtb_option, " Obsolete option, do not use";
-      "-f",        Arg.String set_format,     "chroot|ext2 Set output format";
+      "-f",        Arg.String set_format,     "chroot|ext2|ext4 Set output format";
       "--format",  Arg.String set_format,     ditto;
       "--host-cpu", Arg.Set_string host_cpu,  "ARCH Set host CPU architecture";
       "--if-newer", Arg.Set if_newer,             " Only build if needed";
       "--include-packagelist", Arg.Set include_packagelist,
                                               " Add a file with the list of packages";
+      "--incremental", Arg.Set incremental,   " Update the previous ext2 appliance";
+      "-j",        Arg.Set_int jobs,          "N Use N threads to copy host files";
+      "--jobs",    Arg.Set_int jobs,          ditto;
+      "--layout-trace", Arg.Set_string layout_trace,
+                                              "FILE Place files read at boot first";
       "--list-drivers", Arg.Unit display_drivers, " Display list of drivers and exit";
       "--lock",    Arg.Set_string lockfile,   "LOCKFILE Use a lock file";
       "--names",   Arg.Unit error_supermin_5, " Give an error for people needing supermin 4";
       "-o",        Arg.Set_string outputdir,  "OUTPUTDIR Set output directory";
       "--packager-config", Arg.Set_string packager_config, "CONFIGFILE Set packager config file";
       "--prepare", Arg.Unit set_prepare_mode, " Prepare a supermin appliance";
-      "--size",    Arg.String set_size,       " Set the size of the ext2 filesystem";
+      "--size",    Arg.String set_size,       "SIZE|auto Set the size of the ext2 filesystem";
       "--use-installed", Arg.Set use_installed, " Use installed files instead of accessing network";
       "-v",        Arg.Unit set_debug,        " Enable debugging messages";
       "--verbose", Arg.Unit set_debug,        ditto;
@@ -168,6 +196,9 @@ appliance automatically.
     let anon_fun = add inputs in
     Arg.parse argspec anon_fun usage_msg;
 
+    let chroot_link = !chroot_link in
+    let cache_dir = match !cache_dir with "" -> None | s -> Some s in
+    let compressed_modules = !compressed_modules in
     let copy_kernel = !copy_kernel in
     let debug = !debug in
     let host_cpu = !host_cpu in
@@ -181,6 +212,12 @@ appliance automatically.
     let use_installed = !use_installed in
     let size = !size in
     let include_packagelist = !include_packagelist in
+    let dedup = !dedup in
+    let jobs = !jobs in
+    if jobs < 0 then
+      error "--jobs must be >= 0";
+    let layout_trace =
+      match !layout_trace with "" -> None | s -> Some s in
 
     let format =
       match mode, !format with
@@ -198,11 +235,16 @@ appliance automatically.
       let len = String.length outputdir in
       if outputdir.[len - 1] == '/' then String.sub outputdir 0 (len - 1)
       else outputdir in
+    (* The previous appliance is still in the output directory while
+     * the new one is being built.
+     *)
+    let incremental = if !incremental then Some outputdir else None in
 
     debug, mode, if_newer, inputs, lockfile, outputdir,
     (copy_kernel, format, host_cpu,
      packager_config, tmpdir, use_installed, size,
-     include_packagelist) in
+     include_packagelist, dedup, jobs, layout_trace, incremental,
+     chroot_link, compressed_modules, cache_dir) in
 
   if debug >= 1 then printf "supermin: version: %s\n" Config.package_version;
 
@@ -210,7 +252,7 @@ appliance automatically.
    * This fails with an error if one could not be located.
    *)
   let () =
-    let (_, _, _, packager_config, tmpdir, _, _, _) = args in
+    let (_, _, _, packager_config, tmpdir, _, _, _, _, _, _, _, _, _, _) = args in
     let settings = {
       debug = debug;
       tmpdir = tmpdir;
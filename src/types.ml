@@ -16,4 +16,9 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  *)
 
-type format = Chroot | Ext2
+type format = Chroot | Ext2 | Ext4
+
+(* Size of the ext2 filesystem (--size option). *)
+type size =
+  | Size of int64                    (* fixed size in bytes *)
+  | Auto_size of int                 (* fit the files, plus headroom (%) *)
@@ -0,0 +1,73 @@
+#!/bin/bash -
+# supermin
+# (C) Copyright 2009-2020 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+# Benchmark copying files into the chroot appliance.  This is not run
+# as part of 'make check'.  Run it by hand from the tests/ directory:
+#
+#   ./bench-chroot-copy.sh
+#
+# Set $SUPERMIN_OLD to another supermin binary to compare against
+# (by default 'supermin' from $PATH is used if it exists).  Set
+# $TMPDIR to compare filesystems with and without reflink support.
+
+set -e
+
+old="${SUPERMIN_OLD:-$(command -v supermin ||:)}"
+new=../src/supermin
+
+tmpdir=`mktemp -d`
+trap "rm -rf $tmpdir" EXIT
+
+d1=$tmpdir/d1
+data=$tmpdir/data
+
+# Create a tree of synthetic files, mostly small like a real appliance.
+mkdir -p $data/small $data/medium $data/large
+for i in `seq 1 20000`; do
+    head -c $((i % 8192 + 1)) /dev/urandom > $data/small/$i
+done
+for i in `seq 1 200`; do
+    head -c $((i * 16384)) /dev/urandom > $data/medium/$i
+done
+for i in `seq 1 4`; do
+    head -c $((i * 32 * 1024 * 1024)) /dev/urandom > $data/large/$i
+done
+bytes=`du -sb $data | awk '{print $1}'`
+nr_files=`find $data -type f | wc -l`
+
+# We assume 'bash' is a package everywhere.
+$new --prepare --use-installed bash -o $d1
+echo "$data/*/*" >> $d1/hostfiles
+
+bench ()
+{
+    local name="$1" supermin="$2" start end
+    rm -rf $tmpdir/out
+    sync
+    start=`date +%s.%N`
+    $supermin --build -f chroot $d1 -o $tmpdir/out
+    end=`date +%s.%N`
+    awk -v name="$name" -v s=$start -v e=$end -v b=$bytes -v n=$nr_files \
+        'BEGIN { t = e - s;
+                 printf "%-4s %8.2f s %10.0f files/s %8.1f MB/s\n",
+                        name, t, n / t, b / t / 1e6 }'
+}
+
+echo "copying $nr_files host files, $bytes bytes"
+if [ -n "$old" ]; then bench old "$old"; fi
+bench new $new
@@ -0,0 +1,87 @@
+#!/bin/bash -
+# supermin
+# (C) Copyright 2009-2020 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+# Benchmark booting an ext2 and an ext4 appliance.  This is not run
+# as part of 'make check'.  Run it by hand from the tests/ directory:
+#
+#   ./bench-ext4-boot.sh [ROUNDS]
+#
+# It needs qemu (set $QEMU to override the binary) and preferably
+# KVM.  The root disk is opened with cache=none so that each boot
+# reads from a cold (host) cache.  The guest reports the time from
+# kernel start to /init, and the time to read every file in /usr.
+
+set -e
+
+# XXX Hack for Arch.
+if [ -f /etc/arch-release ]; then
+    export SUPERMIN_KERNEL=/boot/vmlinuz-linux
+fi
+
+rounds=${1:-5}
+qemu="${QEMU:-qemu-system-$(uname -m)}"
+if ! command -v "$qemu" >/dev/null; then
+    echo "$0: $qemu not found, set \$QEMU"
+    exit 77
+fi
+accel=tcg
+if [ -w /dev/kvm ]; then accel=kvm; fi
+
+tmpdir=`mktemp -d`
+trap "rm -rf $tmpdir" EXIT
+
+d1=$tmpdir/d1
+
+../src/supermin --prepare --use-installed bash coreutils tar util-linux -o $d1
+
+cat > $tmpdir/init <<'EOI'
+#!/bin/bash
+mount -t proc proc /proc
+read boot _ < /proc/uptime
+start=`date +%s.%N`
+bytes=`tar cf - /usr 2>/dev/null | wc -c`
+end=`date +%s.%N`
+echo "BENCH $boot $start $end $bytes"
+echo o > /proc/sysrq-trigger
+sleep 60
+EOI
+chmod 0755 $tmpdir/init
+tar -C $tmpdir -zcf $d1/init.tar.gz init
+
+for fmt in ext2 ext4; do
+    ../src/supermin --build -f $fmt --size auto $d1 -o $tmpdir/$fmt
+done
+
+boot ()
+{
+    local fmt=$1
+    "$qemu" -machine accel=$accel -m 1024 -nodefaults -nographic \
+        -serial stdio -no-reboot \
+        -kernel $tmpdir/$fmt/kernel -initrd $tmpdir/$fmt/initrd \
+        -append "console=ttyS0 root=/dev/vda quiet" \
+        -drive file=$tmpdir/$fmt/root,format=raw,if=virtio,cache=none,snapshot=on |
+        tr -d '\r' | grep '^BENCH'
+}
+
+for fmt in ext2 ext4; do
+    for i in `seq 1 $rounds`; do boot $fmt; done |
+    awk -v fmt=$fmt '
+        { boot += $2; t += $4 - $3; bytes += $5; n++ }
+        END { printf "%s: boot to /init %.2f s, read /usr %.2f s (%.1f MB/s)\n",
+                     fmt, boot / n, t / n, bytes / t / 1e6 }'
+done
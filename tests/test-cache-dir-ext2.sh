@@ -0,0 +1,58 @@
+#!/bin/bash -
+# supermin
+# (C) Copyright 2009-2020 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+set -e
+set -x
+
+# XXX Hack for Arch.
+if [ -f /etc/arch-release ]; then
+    export SUPERMIN_KERNEL=/boot/vmlinuz-linux
+fi
+
+tmpdir=`mktemp -d`
+
+d1=$tmpdir/d1
+d2=$tmpdir/d2
+d3=$tmpdir/d3
+cache=$tmpdir/cache
+
+# We assume 'bash' is a package everywhere.
+../src/supermin -v --prepare --use-installed bash -o $d1
+
+# The first build creates the package list and the initrd, and
+# saves them in the cache.
+../src/supermin -v --build -f ext2 --cache-dir $cache $d1 -o $d2 > $tmpdir/log
+grep "saved package list in cache" $tmpdir/log
+grep "saved initrd in cache" $tmpdir/log
+test `ls $cache | wc -l` -eq 2
+
+# The second build reuses them.
+../src/supermin -v --build -f ext2 --cache-dir $cache $d1 -o $d3 > $tmpdir/log
+grep "packages from cache" $tmpdir/log
+grep "using cached initrd" $tmpdir/log
+cmp $d2/initrd $d3/initrd
+
+# Keeping modules compressed needs a different initrd.
+../src/supermin -v --build -f ext2 --cache-dir $cache --compressed-modules \
+    $d1 -o $d3 > $tmpdir/log
+if grep "using cached initrd" $tmpdir/log; then
+    echo "$0: cached initrd was used after changing options"
+    exit 1
+fi
+
+rm -rf $tmpdir ||:
@@ -0,0 +1,51 @@
+#!/bin/bash -
+# supermin
+# (C) Copyright 2009-2020 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+set -e
+set -x
+
+# XXX Hack for Arch.
+if [ -f /etc/arch-release ]; then
+    export SUPERMIN_KERNEL=/boot/vmlinuz-linux
+fi
+
+tmpdir=`mktemp -d`
+
+d1=$tmpdir/d1
+d2=$tmpdir/d2
+files=$tmpdir/files
+
+# The host files are on the same filesystem as the output, so they
+# can be hard linked.
+mkdir $files
+echo a > $files/a
+chmod 0640 $files/a
+
+# We assume 'bash' is a package everywhere.
+../src/supermin -v --prepare --use-installed bash -o $d1
+echo "$files/*" >> $d1/hostfiles
+
+../src/supermin -v --build -f chroot --chroot-link $d1 -o $d2
+
+test "`stat -c %i $files/a`" = "`stat -c %i $d2/$files/a`"
+test "`stat -c %a $d2/$files/a`" = "640"
+
+# Package files are linked or copied.
+cmp $d2/bin/bash /bin/bash || cmp $d2/usr/bin/bash /usr/bin/bash
+
+rm -rf $tmpdir ||:
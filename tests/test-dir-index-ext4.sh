@@ -0,0 +1,70 @@
+#!/bin/bash -
+# supermin
+# (C) Copyright 2009-2020 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+set -e
+set -x
+
+if ! e2fsck -V >/dev/null 2>&1; then
+    echo "$0: test skipped because e2fsck is not installed"
+    exit 77
+fi
+
+# XXX Hack for Arch.
+if [ -f /etc/arch-release ]; then
+    export SUPERMIN_KERNEL=/boot/vmlinuz-linux
+fi
+
+tmpdir=`mktemp -d`
+
+d1=$tmpdir/d1
+d2=$tmpdir/d2
+many=$tmpdir/many
+
+# A directory with enough entries to need a hash index.
+mkdir $many
+for i in `seq 1 5000`; do
+    touch $many/file-with-a-longish-name-$i
+done
+ln -s file-with-a-longish-name-1 $many/symlink
+
+# Some files with content, one spanning many extents' worth of blocks.
+head -c 12345 /dev/urandom > $tmpdir/small
+head -c 5000000 /dev/urandom > $tmpdir/large
+
+# We assume 'bash' is a package everywhere.
+../src/supermin -v --prepare --use-installed bash -o $d1
+echo "$many" >> $d1/hostfiles
+echo "$many/*" >> $d1/hostfiles
+echo "$tmpdir/small" >> $d1/hostfiles
+echo "$tmpdir/large" >> $d1/hostfiles
+
+../src/supermin -v --build -f ext4 $d1 -o $d2
+
+# The filesystem (including the index) must be consistent, and all
+# the entries must be there.
+e2fsck -fn $d2/root
+test `debugfs -R "ls -p $many" $d2/root 2>/dev/null | grep -c longish-name` -eq 5000
+debugfs -R "htree $many" $d2/root 2>/dev/null | grep -q "Root node dump"
+
+# The content of the files must be readable.
+for f in small large; do
+    debugfs -R "dump $tmpdir/$f $tmpdir/$f.out" $d2/root
+    cmp $tmpdir/$f $tmpdir/$f.out
+done
+
+rm -rf $tmpdir ||:
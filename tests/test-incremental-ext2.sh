@@ -0,0 +1,89 @@
+#!/bin/bash -
+# supermin
+# (C) Copyright 2009-2020 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+set -e
+set -x
+
+if ! debugfs -V >/dev/null 2>&1; then
+    echo "$0: test skipped because debugfs is not installed"
+    exit 77
+fi
+
+# XXX Hack for Arch.
+if [ -f /etc/arch-release ]; then
+    export SUPERMIN_KERNEL=/boot/vmlinuz-linux
+fi
+
+tmpdir=`mktemp -d`
+
+d1=$tmpdir/d1
+d2=$tmpdir/d2
+files=$tmpdir/files
+
+mkdir -p $files/dir
+echo a > $files/a
+echo b > $files/b
+echo c > $files/dir/c
+mkdir $files/e
+echo e > $files/e/e
+echo f > $files/f
+
+# We assume 'bash' is a package everywhere.
+../src/supermin -v --prepare --use-installed bash -o $d1
+echo "$files/*" >> $d1/hostfiles
+
+../src/supermin -v --build -f ext2 --incremental $d1 -o $d2
+test -f $d2/manifest
+
+# Change one file, remove one file and one directory, and add a file.
+echo changed > $files/a
+rm $files/b
+rm -r $files/dir
+echo d > $files/d
+
+# Replace a directory by a file, and a file by a directory.
+rm -r $files/e
+echo e > $files/e
+rm $files/f
+mkdir $files/f
+echo g > $files/f/g
+
+../src/supermin -v --build -f ext2 --incremental $d1 -o $d2 > $tmpdir/log
+grep "updating previous appliance" $tmpdir/log
+
+e2fsck -fn $d2/root
+test "`debugfs -R "cat $files/a" $d2/root 2>/dev/null`" = "changed"
+test "`debugfs -R "cat $files/d" $d2/root 2>/dev/null`" = "d"
+test "`debugfs -R "cat $files/e" $d2/root 2>/dev/null`" = "e"
+test "`debugfs -R "cat $files/f/g" $d2/root 2>/dev/null`" = "g"
+for f in b dir; do
+    if debugfs -R "stat $files/$f" $d2/root 2>&1 | grep -q "Inode:"; then
+        echo "$0: $f was not removed"
+        exit 1
+    fi
+done
+
+# Changing the options builds the appliance from scratch.
+../src/supermin -v --build -f ext2 --incremental --dedup $d1 -o $d2 > $tmpdir/log
+if grep "updating previous appliance" $tmpdir/log; then
+    echo "$0: appliance was updated after changing options"
+    exit 1
+fi
+e2fsck -fn $d2/root
+
+rm -rf $tmpdir ||:
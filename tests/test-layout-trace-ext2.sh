@@ -0,0 +1,96 @@
+#!/bin/bash -
+# supermin
+# (C) Copyright 2009-2020 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+set -e
+set -x
+
+if ! debugfs -V >/dev/null 2>&1; then
+    echo "$0: test skipped because debugfs is not installed"
+    exit 77
+fi
+
+# XXX Hack for Arch.
+if [ -f /etc/arch-release ]; then
+    export SUPERMIN_KERNEL=/boot/vmlinuz-linux
+fi
+
+tmpdir=`mktemp -d`
+
+d1=$tmpdir/d1
+d2=$tmpdir/d2
+files=$tmpdir/files
+
+# Three files of 12 blocks each, which fit in the direct blocks, and
+# two large files which need indirect blocks and together fill more
+# than the first block group.
+mkdir $files
+for f in a b c; do
+    dd if=/dev/urandom of=$files/$f bs=4096 count=12
+done
+for f in d e; do
+    dd if=/dev/urandom of=$files/$f bs=1M count=80
+done
+
+# We assume 'bash' is a package everywhere.
+../src/supermin -v --prepare --use-installed bash -o $d1
+echo "$files/*" >> $d1/hostfiles
+
+cat > $tmpdir/trace <<EOT
+# c is read first, then a, then the large files.
+$files/c
+$files/a
+$files/c
+$files/d
+$files/e
+EOT
+
+../src/supermin -v --build -f ext2 --layout-trace $tmpdir/trace $d1 -o $d2
+
+block ()
+{
+    debugfs -R "bmap $1 $2" $d2/root 2>/dev/null
+}
+
+fs_stat ()
+{
+    debugfs -R "stats" $d2/root 2>/dev/null |
+        grep "^$1:" | awk -F: '{print $2}'
+}
+
+# The traced files are placed first, contiguously and in order.
+c=`block $files/c 0`
+a=`block $files/a 0`
+b=`block $files/b 0`
+test $a -eq $((c + 12))
+test $b -gt $a
+
+# The large files follow, beyond the first block group, and before
+# any file which wasn't traced.
+blocks=$((80 * 1024 * 1024 / `fs_stat "Block size"`))
+per_group=`fs_stat "Blocks per group"`
+d=`block $files/d 0`
+d_last=`block $files/d $((blocks - 1))`
+e=`block $files/e 0`
+e_last=`block $files/e $((blocks - 1))`
+test $d -eq $((a + 12))
+test $e -gt $d_last
+test $e_last -gt $e
+test $e_last -ge $per_group
+test $b -gt $e_last
+
+rm -rf $tmpdir ||:
@@ -0,0 +1,45 @@
+#!/bin/bash -
+# supermin
+# (C) Copyright 2009-2020 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+set -e
+set -x
+
+# XXX Hack for Arch.
+if [ -f /etc/arch-release ]; then
+    export SUPERMIN_KERNEL=/boot/vmlinuz-linux
+fi
+
+tmpdir=`mktemp -d`
+
+d1=$tmpdir/d1
+d2=$tmpdir/d2
+d3=$tmpdir/d3
+
+# We assume 'bash' is a package everywhere.
+../src/supermin -v --prepare --use-installed bash -o $d1
+
+# The files must fit into an automatically sized filesystem.
+../src/supermin -v --build -f ext2 --size auto $d1 -o $d2
+size=`stat -c %s $d2/root`
+test $size -lt $((4 * 1024 * 1024 * 1024))
+
+# More headroom gives a bigger filesystem.
+../src/supermin -v --build -f ext2 --size auto+50% $d1 -o $d3
+test `stat -c %s $d3/root` -gt $size
+
+rm -rf $tmpdir ||: